@@ -0,0 +1,148 @@
+#include "ConfigJournal.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+static const char *TAG = "journal";
+
+ConfigJournal::ConfigJournal()
+{
+    path[0] = 0;
+    tmp_path[0] = 0;
+    f = NULL;
+    compacting = false;
+    size = 0;
+    damaged = false;
+    missing = true;
+    write_error = false;
+}
+
+ConfigJournal::~ConfigJournal()
+{
+    if(f)
+        fclose(f);
+}
+
+void ConfigJournal::init(const char* file_path)
+{
+    snprintf(path, sizeof(path), "%s", file_path);
+    snprintf(tmp_path, sizeof(tmp_path), "%.*s.tmp", (int)strlen(path) - 4, path);
+    size = 0;
+    damaged = false;
+    missing = true;
+}
+
+/* Calls fn for every valid record, in the order they were written.
+ * ESP_ERR_NOT_FOUND if there is no journal. */
+esp_err_t ConfigJournal::replay(void (*fn)(void* ctx, uint8_t type, const uint8_t* data, uint16_t len), void* ctx)
+{
+    FILE* rf = fopen(path, "r");
+    if(rf == NULL)
+    {
+        // reset between removing the old file and renaming the compacted one
+        rf = fopen(tmp_path, "r");
+        if(rf == NULL)
+            return ESP_ERR_NOT_FOUND;
+        ESP_LOGW(TAG, "%s: using the compacted journal", path);
+        damaged = true;
+    }
+    missing = false;
+
+    size = 0;
+    uint8_t* buf = new uint8_t[sizeof(journal_hdr_t) + JOURNAL_MAX_RECORD];
+    journal_hdr_t* hdr = (journal_hdr_t*)buf;
+    while(fread(hdr, 1, sizeof(*hdr), rf) == sizeof(*hdr))
+    {
+        uint32_t crc;
+        if(hdr->magic != JOURNAL_MAGIC || hdr->len > JOURNAL_MAX_RECORD ||
+           fread(buf + sizeof(*hdr), 1, hdr->len, rf) != hdr->len ||
+           fread(&crc, 1, sizeof(crc), rf) != sizeof(crc) ||
+           esp_rom_crc32_le(0, buf, sizeof(*hdr) + hdr->len) != crc)
+        {
+            ESP_LOGW(TAG, "%s: damaged record at %d, ignoring the rest", path, (int)size);
+            damaged = true;
+            break;
+        }
+        fn(ctx, hdr->type, buf + sizeof(*hdr), hdr->len);
+        size += sizeof(*hdr) + hdr->len + sizeof(crc);
+    }
+    delete[] buf;
+    fclose(rf);
+    return ESP_OK;
+}
+
+// compact: the records written until end() replace the journal
+esp_err_t ConfigJournal::begin(bool compact)
+{
+    compacting = compact;
+    f = fopen(compact ? tmp_path : path, compact ? "w" : "a");
+    if(f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s for writing", compact ? tmp_path : path);
+        return ESP_FAIL;
+    }
+    if(compact)
+        size = 0;
+    write_error = false;
+    return ESP_OK;
+}
+
+void ConfigJournal::put(uint8_t type, const void* data, uint16_t len)
+{
+    if(f == NULL || write_error)
+        return;
+    if(len > JOURNAL_MAX_RECORD)
+    {
+        ESP_LOGE(TAG, "record of %d bytes is too long", len);
+        write_error = true;
+        return;
+    }
+
+    journal_hdr_t hdr = { JOURNAL_MAGIC, type, len };
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)&hdr, sizeof(hdr));
+    crc = esp_rom_crc32_le(crc, (const uint8_t*)data, len);
+    if(fwrite(&hdr, 1, sizeof(hdr), f) != sizeof(hdr) || fwrite(data, 1, len, f) != len ||
+       fwrite(&crc, 1, sizeof(crc), f) != sizeof(crc))
+    {
+        ESP_LOGE(TAG, "Failed to write to %s: %s", compacting ? tmp_path : path, strerror(errno));
+        write_error = true;
+        return;
+    }
+    size += sizeof(hdr) + len + sizeof(crc);
+}
+
+esp_err_t ConfigJournal::end()
+{
+    if(f == NULL)
+        return ESP_FAIL;
+    // fclose() writes what is still buffered
+    if(fclose(f) != 0 && !write_error)
+    {
+        ESP_LOGE(TAG, "Failed to write to %s: %s", compacting ? tmp_path : path, strerror(errno));
+        write_error = true;
+    }
+    f = NULL;
+    if(write_error)
+    {
+        // a partial record may be behind the valid ones, the next write starts a new journal
+        damaged = true;
+        if(compacting)
+            unlink(tmp_path);
+        return ESP_FAIL;
+    }
+    if(!compacting)
+        return ESP_OK;
+
+    // neither SPIFFS nor FAT rename over an existing file
+    unlink(path);
+    if(rename(tmp_path, path) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to rename %s: %s", tmp_path, strerror(errno));
+        return ESP_FAIL;
+    }
+    damaged = false;
+    missing = false;
+    return ESP_OK;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define JOURNAL_MAGIC       0xa5
+#define JOURNAL_MAX_SIZE    12288   // compacted when it grows beyond this, a few full paint records
+#define JOURNAL_MAX_RECORD  4096    // data bytes of one record
+
+// every record: header, len bytes of data, CRC32 of header and data
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t type;
+    uint16_t len;
+} journal_hdr_t;
+
+/* Append-only file of CRC protected records. Replay stops at the first damaged record,
+ * e.g. an append cut off by a reset. Compaction writes a new file and replaces the old one. */
+class ConfigJournal {
+    char path[40];
+    char tmp_path[40];          // new file while compacting
+    FILE* f;
+    bool compacting;
+    uint32_t size;              // bytes of valid records
+    bool damaged;               // garbage behind the valid records, the next write compacts
+    bool missing;               // no journal yet, the first write must hold everything
+    bool write_error;           // a put() since begin() failed, end() fails too
+
+public:
+    ConfigJournal();
+    ~ConfigJournal();
+
+    void init(const char* file_path);
+    esp_err_t replay(void (*fn)(void* ctx, uint8_t type, const uint8_t* data, uint16_t len), void* ctx);
+    bool needs_compact() { return damaged || missing || size > JOURNAL_MAX_SIZE; }
+    esp_err_t begin(bool compact);
+    void put(uint8_t type, const void* data, uint16_t len);
+    esp_err_t end();
+};
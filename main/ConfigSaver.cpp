@@ -0,0 +1,199 @@
+#include "ConfigSaver.h"
+#include <cstring>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "Ledstrip.h"
+
+static const char *TAG = "ConfigSaver";
+
+#define STACK_SIZE      CONFIG_ESP_MAIN_TASK_STACK_SIZE
+#define QUIET_US        (CONFIG_LED_SAVE_QUIET_MS * 1000LL)
+#define MAX_DELAY_US    (QUIET_US * 10)     // a strip that keeps changing is still written now and then
+
+ConfigSaver* ConfigSaver::instance = NULL;
+
+ConfigSaver::ConfigSaver()
+{
+    memset(pending, 0, sizeof(pending));
+    nr_pending = 0;
+    writing = NULL;
+    lock = xSemaphoreCreateMutex();
+    task = NULL;
+    marks = 0;
+    writes = 0;
+}
+
+ConfigSaver::~ConfigSaver()
+{
+    if(task)
+        vTaskDelete(task);
+    flush();
+    if(instance == this)
+        instance = NULL;
+    vSemaphoreDelete(lock);
+}
+
+void ConfigSaver::c_task(void* arg)
+{
+    ConfigSaver* saver = (ConfigSaver*)arg;
+    saver->loop();
+}
+
+// esp_restart() runs this before the reboot
+void ConfigSaver::on_shutdown()
+{
+    if(instance)
+        instance->flush();
+}
+
+int ConfigSaver::find(Ledstrip* strip)
+{
+    for(int i=0; i<nr_pending; i++)
+    {
+        if(pending[i].strip == strip)
+            return i;
+    }
+    return -1;
+}
+
+// call with lock held, the lock is given while the file is written
+void ConfigSaver::write_slot(int i)
+{
+    Ledstrip* strip = pending[i].strip;
+    pending[i] = pending[--nr_pending];
+    writing = strip;
+    xSemaphoreGive(lock);
+
+    strip->writeConfig();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    writing = NULL;
+    writes++;
+}
+
+esp_err_t ConfigSaver::start()
+{
+    if(xTaskCreate(c_task, "SaveTask", STACK_SIZE, this, 1, &task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "could not create the save task, configs are written at once");
+        task = NULL;
+        return ESP_FAIL;
+    }
+    instance = this;
+    esp_register_shutdown_handler(on_shutdown);
+    return ESP_OK;
+}
+
+// the config of the strip changed, write it when it stays unchanged for a while
+void ConfigSaver::mark(Ledstrip* strip)
+{
+    if(task == NULL)
+    {
+        marks++;
+        writes++;
+        strip->writeConfig();
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    marks++;
+    int i = find(strip);
+    if(i >= 0)
+    {
+        pending[i].last_mark = now;
+    }
+    else if(nr_pending < SAVER_MAX_PENDING)
+    {
+        pending[nr_pending].strip = strip;
+        pending[nr_pending].first_mark = now;
+        pending[nr_pending].last_mark = now;
+        nr_pending++;
+    }
+    else
+    {
+        // no free slot, this one is written at once
+        xSemaphoreGive(lock);
+        strip->writeConfig();
+        xSemaphoreTake(lock, portMAX_DELAY);
+        writes++;
+    }
+    xSemaphoreGive(lock);
+
+    // the task sleeps until the earliest write, a new strip may be due before that
+    if(i < 0)
+        xTaskNotifyGive(task);
+}
+
+// the strip is deleted, write its pending changes now
+void ConfigSaver::remove(Ledstrip* strip)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    while(writing == strip)
+    {
+        xSemaphoreGive(lock);
+        vTaskDelay(1);
+        xSemaphoreTake(lock, portMAX_DELAY);
+    }
+    int i = find(strip);
+    if(i >= 0)
+        write_slot(i);
+    xSemaphoreGive(lock);
+}
+
+// write all pending changes now, e.g. on power off
+void ConfigSaver::flush()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    while(nr_pending > 0)
+        write_slot(0);
+    // the task may be writing a strip that was taken from the list before
+    while(writing)
+    {
+        xSemaphoreGive(lock);
+        vTaskDelay(1);
+        xSemaphoreTake(lock, portMAX_DELAY);
+    }
+    xSemaphoreGive(lock);
+}
+
+void ConfigSaver::loop()
+{
+    while(true)
+    {
+        TickType_t wait = portMAX_DELAY;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        int i = 0;
+        while(i < nr_pending)
+        {
+            int64_t now = esp_timer_get_time();
+            int64_t quiet = now - pending[i].last_mark;
+            if(quiet >= QUIET_US || now - pending[i].first_mark >= MAX_DELAY_US)
+            {
+                // the slot is replaced by the last one, look at i again
+                write_slot(i);
+                continue;
+            }
+            int64_t left = QUIET_US - quiet;
+            if(MAX_DELAY_US - (now - pending[i].first_mark) < left)
+                left = MAX_DELAY_US - (now - pending[i].first_mark);
+            TickType_t t = pdMS_TO_TICKS(left / 1000) + 1;
+            if(t < wait)
+                wait = t;
+            i++;
+        }
+        xSemaphoreGive(lock);
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+string ConfigSaver::to_json()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t m = marks;
+    uint32_t w = writes;
+    xSemaphoreGive(lock);
+    return Ledstrip::to_json("saves_requested", m) + "," +
+        Ledstrip::to_json("saves_written", w) + "," +
+        Ledstrip::to_json("saves_avoided", m - w);
+}
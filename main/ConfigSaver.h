@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#define SAVER_MAX_PENDING   16
+
+using namespace std;
+
+class Ledstrip;
+
+// a strip with changes that are not written yet
+typedef struct {
+    Ledstrip* strip;
+    int64_t first_mark;     // us, the oldest change not written
+    int64_t last_mark;      // us, the latest change
+} saver_slot_t;
+
+/* Writes the configs of the strips in the background. A changed strip is only marked,
+ * it is written once no further change came in for CONFIG_LED_SAVE_QUIET_MS. */
+class ConfigSaver {
+    saver_slot_t pending[SAVER_MAX_PENDING];
+    int nr_pending;
+    Ledstrip* writing;          // written by the task now, outside of the lock
+    SemaphoreHandle_t lock;
+    TaskHandle_t task;
+    uint32_t marks;
+    uint32_t writes;
+    static ConfigSaver* instance;   // for the shutdown handler
+
+    static void c_task(void* arg);
+    static void on_shutdown();
+    void loop();
+    int find(Ledstrip* strip);
+    void write_slot(int i);
+
+public:
+    ConfigSaver();
+    ~ConfigSaver();
+
+    esp_err_t start();
+    void mark(Ledstrip* strip);
+    void remove(Ledstrip* strip);
+    void flush();
+
+    string to_json();
+};
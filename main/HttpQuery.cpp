@@ -0,0 +1,123 @@
+#include "HttpQuery.h"
+#include <string.h>
+#include <stdlib.h>
+
+static inline int hex_digit(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// the query is taken from the uri of the request, without copying it first
+esp_err_t HttpQuery::parse(httpd_req_t* req)
+{
+    return parse_uri(req->uri);
+}
+
+// uri: path and query, e.g. a control message of the WebSocket
+esp_err_t HttpQuery::parse_uri(const char* uri)
+{
+    const char* q = strchr(uri, '?');
+    if(q == NULL)
+    {
+        nr_param = 0;
+        return ESP_ERR_NOT_FOUND;
+    }
+    q++;
+    parse(q, strcspn(q, "#"));
+    return ESP_OK;
+}
+
+/* Every parameter takes at most its raw length plus the zero for the '&' or '=' it replaces,
+ * the last one the zero at the end, so the decoded query always fits into buf. */
+void HttpQuery::parse(const char* query, size_t len)
+{
+    nr_param = 0;
+    if(len >= sizeof(buf))
+        len = sizeof(buf) - 1;
+
+    const char* p = query;
+    const char* end = query + len;
+    char* out = buf;
+    while(p < end)
+    {
+        char* key = out;
+        char* val = NULL;
+        for(; p < end && *p != '&'; p++)
+        {
+            char c = *p;
+            if(c == '=' && val == NULL)
+            {
+                *out++ = 0;
+                val = out;
+                continue;
+            }
+            if(c == '+')
+            {
+                c = ' ';
+            }
+            else if(c == '%' && end - p > 2)
+            {
+                int hi = hex_digit(p[1]);
+                int lo = hex_digit(p[2]);
+                // an invalid escape is kept as it is
+                if(hi >= 0 && lo >= 0)
+                {
+                    c = (char)(hi << 4 | lo);
+                    p += 2;
+                }
+            }
+            *out++ = c;
+        }
+        *out++ = 0;
+        p++;
+
+        if(val == NULL)
+            val = out - 1;
+        if(*key && nr_param < QUERY_MAX_PARAMS)
+        {
+            param[nr_param].key = key;
+            param[nr_param].val = val;
+            param[nr_param].val_len = out - 1 - val;
+            nr_param++;
+        }
+    }
+}
+
+// the first parameter with the key, like httpd_query_key_value()
+const query_param_t* HttpQuery::find(const char* key) const
+{
+    for(int i=0; i<nr_param; i++)
+    {
+        if(strcmp(param[i].key, key) == 0)
+            return &param[i];
+    }
+    return NULL;
+}
+
+// the value is cut to fit into str
+bool HttpQuery::get_str(const char* key, char* str, size_t len) const
+{
+    const query_param_t* qp = find(key);
+    if(qp == NULL || len == 0)
+        return false;
+
+    size_t n = qp->val_len < len - 1 ? qp->val_len : len - 1;
+    memcpy(str, qp->val, n);
+    str[n] = 0;
+    return true;
+}
+
+bool HttpQuery::get_nr(const char* key, uint32_t* nr) const
+{
+    const query_param_t* qp = find(key);
+    if(qp == NULL)
+        return false;
+
+    *nr = strtoul(qp->val, NULL, 10);
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#define QUERY_MAX_LEN       CONFIG_HTTPD_MAX_URI_LEN    // the query is part of the uri
+#define QUERY_MAX_PARAMS    24
+
+// one key=value pair, both decoded and zero terminated in the buffer of the query
+typedef struct {
+    const char* key;
+    const char* val;        // "" for a key without '='
+    uint16_t val_len;
+} query_param_t;
+
+/* The query string of a request, split into its parameters in one pass.
+ * %xx and '+' are decoded on the way, nothing is allocated. */
+class HttpQuery {
+    char buf[QUERY_MAX_LEN];
+    query_param_t param[QUERY_MAX_PARAMS];
+    int nr_param;
+
+public:
+    HttpQuery() : nr_param(0) { buf[0] = 0; }
+
+    esp_err_t parse(httpd_req_t* req);
+    esp_err_t parse_uri(const char* uri);
+    void parse(const char* query, size_t len);
+    int size() const { return nr_param; }
+
+    const query_param_t* find(const char* key) const;
+    bool get_str(const char* key, char* str, size_t len) const;
+    bool get_nr(const char* key, uint32_t* nr) const;
+};
@@ -0,0 +1,240 @@
+#include "LedLayout.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+#include "esp_log.h"
+
+static const char *TAG = "layout";
+
+LedLayout::LedLayout()
+{
+    memset(&cfg, 0, sizeof(cfg));
+    map = NULL;
+    nr_leds = 0;
+    width = 0;
+    height = 0;
+    points = NULL;
+    in_use = false;
+}
+
+LedLayout::~LedLayout()
+{
+    if(map)
+        delete[] map;
+    if(points)
+        delete[] points;
+}
+
+// the cell of every LED, in the order the LEDs are wired, the size of the grid even if not in use
+void LedLayout::build()
+{
+    if(map)
+        delete[] map;
+    map = NULL;
+    width = 0;
+    height = 0;
+    if(nr_leds == 0)
+        return;
+
+    if(cfg.flags & LAYOUT_POINTS)
+    {
+        for(uint32_t i=0; i<cfg.nr_points; i++)
+        {
+            if(points[i].x >= width)
+                width = points[i].x + 1;
+            if(points[i].y >= height)
+                height = points[i].y + 1;
+        }
+    }
+    else if(cfg.width == 0)
+    {
+        width = nr_leds < LAYOUT_MAX_CELLS ? nr_leds : LAYOUT_MAX_CELLS;
+        height = 1;
+    }
+    else
+    {
+        width = cfg.width;
+        height = cfg.height;
+    }
+
+    if(!in_use)
+        return;
+    map = new (std::nothrow) uint16_t[nr_leds];
+    if(map == NULL)
+    {
+        ESP_LOGE(TAG, "no memory for the map of %d LEDs", (int)nr_leds);
+        return;
+    }
+    uint16_t dark = cells();
+    bool columns = cfg.flags & LAYOUT_COLUMNS;
+    uint32_t len = columns ? height : width;     // LEDs per line
+    uint32_t lines = columns ? width : height;
+    for(uint32_t p=0; p<nr_leds; p++)
+    {
+        if(cfg.flags & LAYOUT_POINTS)
+        {
+            map[p] = p < cfg.nr_points ? points[p].y * width + points[p].x : dark;
+            continue;
+        }
+
+        uint32_t line = p / len;
+        uint32_t pos = p % len;
+        if(line >= lines)
+        {
+            map[p] = dark;
+            continue;
+        }
+        if((cfg.flags & LAYOUT_SERPENTINE) && (line & 1))
+            pos = len - 1 - pos;
+        uint32_t x = columns ? line : pos;
+        uint32_t y = columns ? pos : line;
+        if(cfg.flags & LAYOUT_RIGHT)
+            x = width - 1 - x;
+        if(cfg.flags & LAYOUT_BOTTOM)
+            y = height - 1 - y;
+        map[p] = y * width + x;
+    }
+}
+
+// w = 0: no matrix, the LEDs are one row
+esp_err_t LedLayout::set_matrix(uint16_t w, uint16_t h, uint32_t flags)
+{
+    if(w == 0 || h == 0)
+        w = h = 0;
+    if((uint32_t)w * h > LAYOUT_MAX_CELLS)
+    {
+        ESP_LOGE(TAG, "%dx%d are more than %d cells", w, h, LAYOUT_MAX_CELLS);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if(points)
+        delete[] points;
+    points = NULL;
+    cfg.width = w;
+    cfg.height = h;
+    cfg.flags = flags & ~LAYOUT_POINTS;
+    cfg.nr_points = 0;
+    build();
+    return ESP_OK;
+}
+
+// LED i shows the cell p[i], the grid is as large as the points need
+esp_err_t LedLayout::set_points(const layout_point_t* p, uint32_t n)
+{
+    if(n == 0 || n > LAYOUT_MAX_POINTS)
+        return ESP_ERR_INVALID_SIZE;
+
+    uint32_t w = 0;
+    uint32_t h = 0;
+    for(uint32_t i=0; i<n; i++)
+    {
+        if(p[i].x >= w)
+            w = p[i].x + 1;
+        if(p[i].y >= h)
+            h = p[i].y + 1;
+    }
+    if(w * h > LAYOUT_MAX_CELLS)
+        return ESP_ERR_INVALID_SIZE;
+
+    layout_point_t* pts = new layout_point_t[n];
+    memcpy(pts, p, n * sizeof(layout_point_t));
+    if(points)
+        delete[] points;
+    points = pts;
+    cfg.width = w;
+    cfg.height = h;
+    cfg.flags = LAYOUT_POINTS;
+    cfg.nr_points = n;
+    build();
+    return ESP_OK;
+}
+
+// text file with one "x,y" per LED, e.g. uploaded with the file server
+esp_err_t LedLayout::load_points(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    layout_point_t* p = new layout_point_t[LAYOUT_MAX_POINTS];
+    uint32_t n = 0;
+    unsigned x, y;
+    while(n < LAYOUT_MAX_POINTS && fscanf(f, " %u%*[ ,;]%u", &x, &y) == 2)
+    {
+        if(x > UINT8_MAX || y > UINT8_MAX)
+            break;
+        p[n].x = x;
+        p[n].y = y;
+        n++;
+    }
+    fclose(f);
+
+    esp_err_t ret = set_points(p, n);
+    if(ret != ESP_OK)
+        ESP_LOGE(TAG, "%s: no valid point list", path);
+    delete[] p;
+    return ret;
+}
+
+// the strip got a new number of LEDs
+void LedLayout::resize(uint32_t leds)
+{
+    if(leds == nr_leds && (map || leds == 0 || !in_use))
+        return;
+    nr_leds = leds;
+    build();
+}
+
+void LedLayout::use(bool on)
+{
+    if(on == in_use)
+        return;
+    in_use = on;
+    build();
+}
+
+void LedLayout::save(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if(f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s for writing", path);
+        return;
+    }
+    if(fwrite(&cfg, 1, sizeof(cfg), f) != sizeof(cfg) ||
+       fwrite(points, sizeof(layout_point_t), cfg.nr_points, f) != cfg.nr_points)
+    {
+        ESP_LOGE(TAG, "Failed to write to %s: %s", path, strerror(errno));
+    }
+    fclose(f);
+}
+
+void LedLayout::restore(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+        return;
+
+    layout_config_t fcfg;
+    if(fread(&fcfg, 1, sizeof(fcfg), f) == sizeof(fcfg))
+    {
+        if(fcfg.flags & LAYOUT_POINTS)
+        {
+            if(fcfg.nr_points > 0 && fcfg.nr_points <= LAYOUT_MAX_POINTS)
+            {
+                layout_point_t* p = new layout_point_t[fcfg.nr_points];
+                if(fread(p, sizeof(layout_point_t), fcfg.nr_points, f) == fcfg.nr_points)
+                    set_points(p, fcfg.nr_points);
+                delete[] p;
+            }
+        }
+        else
+        {
+            set_matrix(fcfg.width, fcfg.height, fcfg.flags);
+        }
+    }
+    fclose(f);
+}
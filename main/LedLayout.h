@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define LAYOUT_MAX_CELLS    0xfffe  // cell numbers are uint16_t, 0xffff is left for the dark cell
+#define LAYOUT_MAX_POINTS   4096
+#define LAYOUT_CELLS_PER_LED 4      // a grid may have gaps, but not many more cells than LEDs
+
+// wiring of a matrix
+#define LAYOUT_SERPENTINE   0x01    // every other line runs backwards
+#define LAYOUT_COLUMNS      0x02    // the LEDs run along the columns
+#define LAYOUT_RIGHT        0x04    // the first LED is in the right column
+#define LAYOUT_BOTTOM       0x08    // the first LED is in the bottom row
+#define LAYOUT_POINTS       0x10    // the cell of every LED is given by a point list
+
+// what the layout is built from, width = 0: the LEDs are one row
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint32_t flags;
+    uint32_t nr_points;
+} layout_config_t;
+
+typedef struct {
+    uint8_t x;
+    uint8_t y;
+} layout_point_t;
+
+/* Maps the physical LEDs of a strip to the cells of a width x height grid, 2D effects render into the grid.
+ * The map is built once, when the layout or the number of LEDs changes, and applied in one gather pass.
+ * It only takes RAM while it is in use. */
+class LedLayout {
+    uint16_t* map;              // cell of every LED, y * width + x, cells() for LEDs outside the grid
+    uint32_t nr_leds;
+    uint16_t width;             // of the grid in use, also without a layout
+    uint16_t height;
+    layout_point_t* points;
+    bool in_use;                // a 2D effect renders, only then the map is kept
+
+    void build();
+
+public:
+    layout_config_t cfg;
+
+    LedLayout();
+    ~LedLayout();
+
+    esp_err_t set_matrix(uint16_t w, uint16_t h, uint32_t flags);
+    esp_err_t set_points(const layout_point_t* p, uint32_t n);
+    esp_err_t load_points(const char* path);
+    void resize(uint32_t leds);
+    void use(bool on);
+    void save(const char* path);
+    void restore(const char* path);
+
+    uint16_t grid_width() const { return width; }
+    uint16_t grid_height() const { return height; }
+    uint32_t cells() const { return (uint32_t)width * height; }
+    const uint16_t* index_map() const { return map; }
+    bool used() const { return in_use; }
+};
@@ -8,21 +8,71 @@
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "Ledstrip.h"
+#include "hsv.h"
+#include "font5x7.h"
+#include "timesvc.h"
+#include "esp_random.h"
 #include <cmath>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
 #include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <unistd.h>
 
 #define EXAMPLE_LED_NUMBERS         CONFIG_LED_NUMBERS
 #define MAX_LEDS 10000
 #define SPEED_MAX_VAL   100
 #define PERIOD_SECOND   1000
-#define PERIOD_MIN      10
-#define STACK_SIZE      CONFIG_ESP_MAIN_TASK_STACK_SIZE
+#define FADE_PERIOD     (PERIOD_SECOND / CONFIG_LED_FADE_RATE)
+#define XFADE_US        (CONFIG_LED_XFADE_MS * 1000LL)
+#define FIRE_COOLING    55      // less cooling = taller flames
+#define FIRE_SPARKING   120     // chance (of 255) for a new spark per frame
+#define FIRE_SPARK_LEDS 7       // sparks ignite within the first LEDs
+#define FIRE_MAX_STEPS  8       // simulation steps per frame at most
+#define ANIM_MAX_GAP_US 1000000 // a longer stall does not move the animation further
+#define CLOCK_HOUR_WIDTH 1      // LEDs of the hour hand on each side of its center
 
 static const char *TAG = "leds";
 
+// journal records of the config
+#define CFG_SCHEMA      1       // version of the fields below
+#define REC_SCHEMA      1       // uint16_t version, first record of a compacted journal
+#define REC_FIELDS      2       // changed fields, each: id, size, value
+#define REC_STOPS       3       // gradient stops, 3 bytes each
+#define REC_PAINT       4       // painted LEDs, each: uint16_t index, 3 bytes color
+#define PAINT_MAX_LEDS  512
+#define GRADIENT_MAX_STOPS 64
+// a state record always fits, JOURNAL_MAX_SIZE holds several of them
+static_assert(PAINT_MAX_LEDS * 5 <= JOURNAL_MAX_RECORD && GRADIENT_MAX_STOPS * 3 <= JOURNAL_MAX_RECORD, "state records");
+
+typedef struct {
+    uint8_t id;
+    uint8_t size;
+    uint16_t offset;
+} cfg_field_t;
+
+#define CFG_FIELD(id, member)   { id, sizeof(led_config_t::member), offsetof(led_config_t, member) }
+
+// the ids are stored in the journal, never change or reuse them
+static const cfg_field_t cfg_fields[] = {
+    CFG_FIELD(1, num_leds),
+    CFG_FIELD(2, led1),
+    CFG_FIELD(3, counterclock),
+    CFG_FIELD(4, algorithm),
+    CFG_FIELD(5, color1),
+    CFG_FIELD(6, color2),
+    CFG_FIELD(7, bright),
+    CFG_FIELD(8, speed),
+    CFG_FIELD(9, gradients),
+    CFG_FIELD(10, power),
+    CFG_FIELD(11, name),
+    CFG_FIELD(12, fadein_ms),
+    CFG_FIELD(13, gamma),
+    CFG_FIELD(14, white),
+};
+
 void c_monocolor(Ledstrip* pL)      { pL->monocolor(); }
 void c_rainbow(Ledstrip* pL)        { pL->rainbow(); }
 void c_rainbow_clock(Ledstrip* pL)  { pL->rainbow_clock(); }
@@ -31,107 +81,381 @@ void c_clock2(Ledstrip* pL)         { pL->clock2(); }
 void c_gradient(Ledstrip* pL)       { pL->gradient(); }
 void c_belt(Ledstrip* pL)           { pL->belt(); }
 void c_fire(Ledstrip* pL)           { pL->fire(); }
-
-const ledfunc_table_t Ledstrip::ledfunc_table[] = {
-        { ALGO_MONO,        "/mono",        c_monocolor },
-        { ALGO_RAINBOW,     "/rainbow",     c_rainbow },
-        { ALGO_RAINBOWCLK,  "/rainbowclk",  c_rainbow_clock },
-        { ALGO_WALK,        "/walk",        c_walk },
-        { ALGO_CLOCK2,      "/clock2",      c_clock2 },
-        { ALGO_GRADIENT,    "/gradient",    c_gradient },
-        { ALGO_BELT,        "/belt",        c_belt },
-        { ALGO_FIRE,        "/fire",        c_fire },
-        { ALGO_END,              "",             nullptr },
+void c_plasma(Ledstrip* pL)         { pL->plasma(); }
+void c_ticker(Ledstrip* pL)         { pL->ticker(); }
+void c_firstled(Ledstrip* pL, color_t c)        { pL->firstled(c); }
+void c_add_gradient(Ledstrip* pL, color_t c)    { pL->add_gradient(c); }
+
+static uint32_t period_second(const led_config_t& cfg)  { return PERIOD_SECOND; }
+// moving effects are rendered at a fixed rate, their speed is applied by advance()
+static uint32_t period_frame(const led_config_t& cfg)   { return PERIOD_SECOND / CONFIG_LED_FRAME_RATE; }
+// the second hand moves by one LED
+static uint32_t period_clock(const led_config_t& cfg)   { return PERIOD_SECOND * 60 / cfg.num_leds; }
+
+constexpr ledfunc_table_t Ledstrip::ledfunc_table[] = {
+        { ALGO_MONO,        "/mono",        c_monocolor,        period_second,  EFFECT_STATIC,  nullptr },
+        { ALGO_RAINBOW,     "/rainbow",     c_rainbow,          period_frame,   EFFECT_ROTATE | EFFECT_SUBPIXEL, nullptr },
+        { ALGO_RAINBOWCLK,  "/rainbowclk",  c_rainbow_clock,    period_second,  EFFECT_TIMED,   nullptr },
+        { ALGO_WALK,        "/walk",        c_walk,             period_frame,   EFFECT_RING | EFFECT_SUBPIXEL | EFFECT_PAINTED, c_firstled },
+        { ALGO_CLOCK2,      "/clock2",      c_clock2,           period_clock,   EFFECT_TIMED | EFFECT_COLOR2, nullptr },
+        { ALGO_GRADIENT,    "/gradient",    c_gradient,         period_frame,   EFFECT_ROTATE | EFFECT_SUBPIXEL | EFFECT_STOPS, c_add_gradient },
+        { ALGO_BELT,        "/belt",        c_belt,             period_frame,   EFFECT_RING,    nullptr },
+        { ALGO_FIRE,        "/fire",        c_fire,             period_frame,   0,              nullptr },
+        { ALGO_PLASMA,      "/plasma",      c_plasma,           period_frame,   EFFECT_2D,      nullptr },
+        { ALGO_TEXT,        "/text",        c_ticker,           period_frame,   EFFECT_2D,      nullptr },
+        { ALGO_END,              "",             nullptr,            period_second,  0,              nullptr },
 };
 
+// entry of the algorithm, the ALGO_END entry if unknown
+const ledfunc_table_t* Ledstrip::effect(ledstrip_algo_t algo)
+{
+    int i;
+    for(i=0; ledfunc_table[i].algo != ALGO_END; i++)
+    {
+        if(ledfunc_table[i].algo == algo)
+            break;
+    }
+    return &ledfunc_table[i];
+}
+
 Ledstrip::Ledstrip()
 {
     memset(&cfg, 0, sizeof(led_config_t));
+    memset(&saved_cfg, 0, sizeof(led_config_t));
     led_strip_pixels = NULL;
-    rmt_pixels = NULL;
-    mainTask = 0;
-    lastSec = -1;
+    for(int b=0; b<2; b++)
+    {
+        pixel_buf[b] = NULL;
+        wire_free[b] = xSemaphoreCreateBinary();
+        wire_deadline[b] = 0;
+        wire_done[b] = 0;
+    }
+    // the frame being rendered is owned by this task, the other one is free
+    wire_buf = 0;
+    xSemaphoreGive(wire_free[1]);
+    // 1.5 KB, on the heap like the pixels
+    out_lut = new output_lut_t[2];
+    memset(out_lut, 0, 2 * sizeof(output_lut_t));
+    memset(wire_frame, 0, sizeof(wire_frame));
+    gamma_curve_of = 0;
+    time_gen = 0;
+    face = NULL;
+    face_leds = 0;
     startled = 0;
+    ring_head = 0;
+    mirror = 0;
+    memset(&base_key, 0, sizeof(base_key));
+    base_valid = false;
+    heat = NULL;
+    shown_algo = ALGO_END;
+    xfade = false;
+    xfade_start = 0;
+    xfade_from = NULL;
+    xfade_out[0] = NULL;
+    xfade_out[1] = NULL;
+    anim_time = 0;
+    anim_frac = 0;
+    anim_steps = 0;
+    anim_pos = 0;
+    rng_state = 1;
     cfgfile_path[0] = 0;
     rmt = NULL;
+    sched = NULL;
+    saver = NULL;
+    render_due = 0;
     fade_in = 0;
     startTime = 0;
+    deadline = 0;
+    missed_deadlines = 0;
+    sent_valid = false;
+    behind = false;
+    sent_dark = false;
+    last_sent = 0;
+    frames_sent = 0;
+    frames_skipped = 0;
+    jitter_max = 0;
+    jitter_sum = 0;
+    jitter_cnt = 0;
+    preview = NULL;
+    parent = NULL;
+    seg_start = 0;
+    seg_len = 0;
+    seg_woken = false;
+    memset(seg, 0, sizeof(seg));
+    nr_seg = 0;
+    seg_mutex = xSemaphoreCreateMutex();
+    canvas = NULL;
+    memset(member, 0, sizeof(member));
+    nr_members = 0;
+    phys[0] = phys[1] = NULL;
+    phys_buf = 0;
+    own_buf[0] = own_buf[1] = NULL;
+    force_send = false;
+    grid = NULL;
+    text[0] = 0;
+    text_cols = NULL;
+    text_len = 0;
+    text_width = 0;
 }
 
 Ledstrip::~Ledstrip()
 {
-    mainTask = 0;
+    if(sched)
+        sched->remove(this);
+    if(saver)
+        saver->remove(this);
+    if(nr_members)
+        set_canvas(NULL, 0);
+    for(int i=0; i<nr_seg; i++)
+        delete seg[i];
+    nr_seg = 0;
     new_led_strip_pixels(0);
+    if(text_cols)
+        delete[] text_cols;
+    if(face)
+        delete[] face;
+    for(int b=0; b<2; b++)
+        vSemaphoreDelete(wire_free[b]);
+    delete[] out_lut;
+    vSemaphoreDelete(seg_mutex);
 }
 
 /**
- * @brief Simple helper function, converting HSV color space to RGB color space
+ * @brief Simple helper function, converting HSV color space to a pixel
  *
  * Wiki: https://en.wikipedia.org/wiki/HSL_and_HSV
  *
  */
-void led_strip_hsv2rgb(uint32_t h, uint32_t s, uint32_t v, uint32_t *r, uint32_t *g, uint32_t *b)
+static color_t led_strip_hsv2rgb(uint32_t h, uint8_t s, uint8_t v)
 {
-    h %= 360; // h -> [0,360]
-    uint32_t rgb_max = v * 2.55f;
-    uint32_t rgb_min = rgb_max * (100 - s) / 100.0f;
+    color_t c;
+    hsv2rgb(h, s, v, &c.red, &c.green, &c.blue);
+    return c;
+}
 
-    uint32_t i = h / 60;
-    uint32_t diff = h % 60;
+// the config is written by the saver, once it stays unchanged for a while
+void Ledstrip::saveConfig()
+{
+    if(saver)
+        saver->mark(this);
+    else
+        writeConfig();
+}
 
-    // RGB adjustment amount by hue
-    uint32_t rgb_adj = (rgb_max - rgb_min) * diff / 60;
+// the saver task writes a snapshot, the render task may reallocate the pixels meanwhile
+void Ledstrip::writeConfig()
+{
+    // the mutex is not recursive, a task holding it would wait for itself
+    configASSERT(xSemaphoreGetMutexHolder(render_mutex()) != xTaskGetCurrentTaskHandle());
+    xSemaphoreTake(render_mutex(), portMAX_DELAY);
+    led_config_t c = cfg;
+    string data;
+    uint8_t type = pixel_state(data);
+    string t = text;
+    xSemaphoreGive(render_mutex());
+
+    write_journal(c, type ? (char)type + data : saved_state, journal.needs_compact());
+    writeText(t);
+}
 
-    switch (i) {
-    case 0:
-        *r = rgb_max;
-        *g = rgb_min + rgb_adj;
-        *b = rgb_min;
-        break;
-    case 1:
-        *r = rgb_max - rgb_adj;
-        *g = rgb_max;
-        *b = rgb_min;
-        break;
-    case 2:
-        *r = rgb_min;
-        *g = rgb_max;
-        *b = rgb_min + rgb_adj;
+/* Only the fields that changed since the last write are appended, and the pixel state if it changed.
+ * state: record type and data, compact: the journal is replaced by one that holds everything. */
+void Ledstrip::write_journal(const led_config_t& c, const string& state, bool compact)
+{
+    string fields;
+    for(const cfg_field_t& fd : cfg_fields)
+    {
+        const char* v = (const char*)&c + fd.offset;
+        if(compact || memcmp(v, (const char*)&saved_cfg + fd.offset, fd.size) != 0)
+        {
+            fields += (char)fd.id;
+            fields += (char)fd.size;
+            fields.append(v, fd.size);
+        }
+    }
+
+    if(fields.empty() && state == saved_state && !compact)
+        return;
+
+    if(journal.begin(compact) != ESP_OK)
+        return;
+    if(compact)
+    {
+        uint16_t version = CFG_SCHEMA;
+        journal.put(REC_SCHEMA, &version, sizeof(version));
+    }
+    if(!fields.empty())
+        journal.put(REC_FIELDS, fields.data(), fields.size());
+    // a compacted journal keeps the state of the last effect that had one
+    if(!state.empty() && (state != saved_state || compact))
+        journal.put(state[0], state.data() + 1, state.size() - 1);
+    if(journal.end() == ESP_OK)
+    {
+        saved_cfg = c;
+        saved_state = state;
+    }
+}
+
+// the part of the pixels that can not be rendered from the config, 0 if there is none
+uint8_t Ledstrip::pixel_state(string& data)
+{
+    data.clear();
+    uint32_t n = cfg.num_leds;
+    if(led_strip_pixels == NULL || n == 0)
+        return 0;
+    // the last frame, the one rendered now may not have caught up yet
+    const color_t* px = behind ? pixel_buf[wire_buf ^ 1] : led_strip_pixels;
+
+    uint32_t flags = effect(cfg.algorithm)->flags;
+    if(flags & EFFECT_STOPS)
+    {
+        // gradient() reads its stops from these LEDs
+        uint32_t stops = cfg.gradients < 2 ? 2 : cfg.gradients;
+        if(stops > GRADIENT_MAX_STOPS)
+            stops = GRADIENT_MAX_STOPS;
+        for(uint32_t g=0; g<stops; g++)
+            data.append((const char*)&px[n * g / stops], sizeof(color_t));
+        return REC_STOPS;
+    }
+    if(flags & EFFECT_PAINTED)
+    {
+        for(uint32_t j=0; j<n && data.size() < PAINT_MAX_LEDS * 5; j++)
+        {
+            const color_t& c = px[j];
+            if(c.red == 0 && c.green == 0 && c.blue == 0)
+                continue;
+            data += (char)(j & 0xff);
+            data += (char)(j >> 8);
+            data.append((const char*)&c, sizeof(color_t));
+        }
+        return REC_PAINT;
+    }
+    return 0;
+}
+
+// pixels from a state record, the other pixels are dark
+void Ledstrip::apply_state(const string& state)
+{
+    uint32_t n = cfg.num_leds;
+    for(int b=0; b<2; b++)
+    {
+        if(pixel_buf[b])
+            memset(pixel_buf[b], 0, led_strip_size());
+    }
+    if(state.empty() || led_strip_pixels == NULL || n == 0)
+        return;
+
+    const char* data = state.data() + 1;
+    size_t len = state.size() - 1;
+    if(state[0] == REC_STOPS)
+    {
+        uint32_t stops = len / sizeof(color_t);
+        for(uint32_t g=0; g<stops; g++)
+            memcpy(&led_strip_pixels[n * g / stops], data + g * sizeof(color_t), sizeof(color_t));
+    }
+    else if(state[0] == REC_PAINT)
+    {
+        for(size_t i=0; i + 5 <= len; i += 5)
+        {
+            uint32_t j = (uint8_t)data[i] | ((uint8_t)data[i + 1] << 8);
+            if(j < n)
+                memcpy(&led_strip_pixels[j], data + i + 2, sizeof(color_t));
+        }
+    }
+}
+
+// the results of a journal replay
+typedef struct {
+    led_config_t* cfg;
+    uint16_t schema;
+    string state;
+} journal_replay_t;
+
+static void replay_record(void* ctx, uint8_t type, const uint8_t* data, uint16_t len)
+{
+    journal_replay_t* r = (journal_replay_t*)ctx;
+    switch(type)
+    {
+    case REC_SCHEMA:
+        if(len >= sizeof(uint16_t))
+            memcpy(&r->schema, data, sizeof(uint16_t));
+        if(r->schema > CFG_SCHEMA)
+            ESP_LOGW(TAG, "config of schema %d, only the known fields are used", r->schema);
         break;
-    case 3:
-        *r = rgb_min;
-        *g = rgb_max - rgb_adj;
-        *b = rgb_max;
+    case REC_FIELDS:
+        for(uint16_t i=0; i + 2 <= len && i + 2 + data[i + 1] <= len; i += 2 + data[i + 1])
+        {
+            // fields are found by id, a field that changed its size is cut or padded with 0
+            for(const cfg_field_t& fd : cfg_fields)
+            {
+                if(fd.id != data[i])
+                    continue;
+                uint8_t* v = (uint8_t*)r->cfg + fd.offset;
+                uint8_t size = data[i + 1];
+                memset(v, 0, fd.size);
+                memcpy(v, data + i + 2, size < fd.size ? size : fd.size);
+            }
+        }
         break;
-    case 4:
-        *r = rgb_min + rgb_adj;
-        *g = rgb_min;
-        *b = rgb_max;
+    case REC_STOPS:
+    case REC_PAINT:
+        r->state.assign(1, (char)type);
+        r->state.append((const char*)data, len);
         break;
     default:
-        *r = rgb_max;
-        *g = rgb_min;
-        *b = rgb_max - rgb_adj;
+        // written by a newer version
         break;
     }
 }
 
-void Ledstrip::saveConfig()
+// config<gpio>.bin of older versions: led_config_t and all pixels, the size must match exactly
+// the settings added since are linear and unscaled, as the first release sent them
+void config_from_v0(led_config_t& cfg, const led_config_v0_t& v0)
 {
-    FILE* f = fopen(cfgfile_path, "w");
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open %s for writing", cfgfile_path);
-        return;
-    }
-    if(fwrite(&cfg, 1, sizeof(cfg), f) != sizeof(cfg))
+    memset(&cfg, 0, sizeof(led_config_t));
+    cfg.num_leds = v0.num_leds;
+    cfg.led1 = v0.led1;
+    cfg.counterclock = v0.counterclock;
+    cfg.algorithm = v0.algorithm;
+    cfg.color1 = v0.color1;
+    cfg.color2 = v0.color2;
+    cfg.bright = v0.bright;
+    cfg.speed = v0.speed;
+    cfg.gradients = v0.gradients;
+    cfg.power = v0.power;
+    memcpy(cfg.name, v0.name, sizeof(cfg.name));
+    cfg.fadein_ms = v0.fadein_ms;
+    cfg.gamma = 10;
+    cfg.white = { 255, 255, 255 };
+}
+
+bool Ledstrip::restoreLegacy()
+{
+    FILE* f = fopen(cfgfile_path, "r");
+    if(f == NULL)
+        return false;
+
+    // only the released firmware wrote this file: its config, then the pixels
+    led_config_v0_t fcfg;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    bool ok = fread(&fcfg, 1, sizeof(fcfg), f) == sizeof(fcfg) && fcfg.num_leds < MAX_LEDS &&
+              size == (long)(sizeof(fcfg) + fcfg.num_leds * sizeof(color_t));
+    if(ok)
     {
-        ESP_LOGE(TAG, "Failed to write to %s: %s", cfgfile_path, strerror(errno));
+        config_from_v0(cfg, fcfg);
+        new_led_strip_pixels(cfg.num_leds);
+        ok = fread(led_strip_pixels, 1, led_strip_size(), f) == led_strip_size();
     }
-    if(fwrite(led_strip_pixels, 1, led_strip_size(), f) != led_strip_size())
+    fclose(f);
+    if(!ok)
     {
-        ESP_LOGE(TAG, "Failed to write to %s: %s", cfgfile_path, strerror(errno));
+        ESP_LOGE(TAG, "%s does not match this version. Using default config", cfgfile_path);
+        return false;
     }
-    fclose(f);
+    ESP_LOGI(TAG, "converting %s to a journal", cfgfile_path);
+    return true;
 }
 
 void Ledstrip::restoreConfig()
@@ -143,63 +467,304 @@ void Ledstrip::restoreConfig()
     cfg.color2.blue = 255;
     cfg.gradients = 1;
     cfg.power = true;
-    sprintf(cfg.name, "Strip GPIO%d", gpio_nr);
-
-    FILE* f = fopen(cfgfile_path, "r");
-    if (f == NULL) 
+    cfg.gamma = 10;
+    cfg.white = { 255, 255, 255 };
+    if(parent)
+        snprintf(cfg.name, sizeof(cfg.name), "GPIO%d LED%d", gpio_nr, seg_start);
+    else if(gpio_nr == GPIO_NUM_NC)
+        strcpy(cfg.name, "Canvas");
+    else
+        sprintf(cfg.name, "Strip GPIO%d", gpio_nr);
+
+    char path[40];
+    snprintf(path, sizeof(path), "%.*s.jnl", (int)strlen(cfgfile_path) - 4, cfgfile_path);
+    journal.init(path);
+    led_config_t defaults = cfg;
+    journal_replay_t r = { &cfg, 0, "" };
+    saved_state.clear();
+    if(journal.replay(replay_record, &r) == ESP_OK)
     {
-        ESP_LOGW(TAG, "Failed to open %s. Using default config", cfgfile_path);
+        if(cfg.num_leds >= MAX_LEDS)
+            cfg.num_leds = defaults.num_leds;
+        if(cfg.gradients > GRADIENT_MAX_STOPS)
+            cfg.gradients = GRADIENT_MAX_STOPS;
+        cfg.name[sizeof(cfg.name) - 1] = 0;
         new_led_strip_pixels(cfg.num_leds);
+        apply_state(r.state);
+        saved_cfg = cfg;
+        saved_state = r.state;
     }
-    else 
+    else if(restoreLegacy())
     {
-        led_config_t fcfg;
-        if(fread(&fcfg, 1, sizeof(led_config_t), f) != sizeof(led_config_t))
-        {
-            ESP_LOGE(TAG, "Failed to read %s. Using default config", cfgfile_path);
-        }
-        if(fcfg.num_leds < MAX_LEDS)
-        {
-            memcpy(&cfg, &fcfg, sizeof(led_config_t));
-            new_led_strip_pixels(cfg.num_leds);
-            if(fread(led_strip_pixels, 1, led_strip_size(), f) != led_strip_size())
-            {
-                ESP_LOGE(TAG, "Failed to read %s. Using default config", cfgfile_path);
-            }
-        }
-        fclose(f);
+        // the first write converts it, the old file is not needed after that
+        string data;
+        uint8_t type = pixel_state(data);
+        write_journal(cfg, type ? (char)type + data : "", true);
+        if(!journal.needs_compact())
+            unlink(cfgfile_path);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "No config in %s. Using default config", path);
+        cfg = defaults;
+        new_led_strip_pixels(cfg.num_leds);
+        apply_state("");
     }
+    if(cfg.gamma < 10 || cfg.gamma > 30)
+        cfg.gamma = 10;
+    if(cfg.white.red == 0 && cfg.white.green == 0 && cfg.white.blue == 0)
+        cfg.white = { 255, 255, 255 };
     startled = cfg.led1;
+    restoreLayout();
+    restoreText();
+}
+
+// file next to the config file, e.g. config4_map.bin
+void Ledstrip::side_path(char* path, size_t len, const char* suffix)
+{
+    snprintf(path, len, "%.*s_%s", (int)strlen(cfgfile_path) - 4, cfgfile_path, suffix);
+}
+
+void Ledstrip::restoreLayout()
+{
+    char path[40];
+    side_path(path, sizeof(path), "map.bin");
+    layout.restore(path);
+    new_grid();
+}
+
+void Ledstrip::restoreText()
+{
+    char path[40];
+    side_path(path, sizeof(path), "text.txt");
+    text[0] = 0;
+    saved_text.clear();
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+        return;
+    size_t n = fread(text, 1, sizeof(text) - 1, f);
+    text[n] = 0;
+    fclose(f);
+    saved_text = text;
+}
+
+// text.txt is written with the config, only if the text changed
+void Ledstrip::writeText(const string& s)
+{
+    if(s == saved_text)
+        return;
+
+    char path[40];
+    side_path(path, sizeof(path), "text.txt");
+    FILE* f = fopen(path, "w");
+    if(f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s for writing", path);
+        return;
+    }
+    bool ok = fputs(s.c_str(), f) >= 0;
+    if(fclose(f) == 0 && ok)
+        saved_text = s;
+}
+
+// text of the ticker, empty for the time of day
+void Ledstrip::set_text(const char* s)
+{
+    xSemaphoreTake(render_mutex(), portMAX_DELAY);
+    bool changed = strncmp(text, s, sizeof(text) - 1) != 0;
+    if(changed)
+        snprintf(text, sizeof(text), "%s", s);
+    xSemaphoreGive(render_mutex());
+    if(changed)
+        saveConfig();
+}
+
+/* The color wheel paints into the pixels of a painted effect, restart: from a dark strip.
+ * The render task copies the pixels to the other buffer, it must not run meanwhile. */
+void Ledstrip::paint(color_t color, bool restart)
+{
+    const ledfunc_table_t* fx = effect(cfg.algorithm);
+    if(fx->paint == nullptr)
+        return;
+    xSemaphoreTake(render_mutex(), portMAX_DELAY);
+    catch_up();
+    if(restart)
+    {
+        dark();
+        firstled(color);
+    }
+    else
+    {
+        fx->paint(this, color);
+    }
+    xSemaphoreGive(render_mutex());
+}
+
+// the grid of the layout, for the current number of LEDs, only while a 2D effect is shown
+void Ledstrip::new_grid()
+{
+    if(grid)
+        delete[] grid;
+    grid = NULL;
+    bool in_use = cfg.num_leds > 0 && (effect(cfg.algorithm)->flags & EFFECT_2D);
+    layout.resize(cfg.num_leds);
+    layout.use(in_use);
+    if(!in_use)
+        return;
+
+    uint32_t n = layout.cells();
+    if(n > LAYOUT_CELLS_PER_LED * cfg.num_leds)
+    {
+        ESP_LOGE(TAG, "GPIO %d: a grid of %d cells is too large for %d LEDs", gpio_nr, (int)n, cfg.num_leds);
+        return;
+    }
+    grid = new (std::nothrow) color_t[n + 1];
+    if(grid)
+        memset(grid, 0, (n + 1) * sizeof(color_t));
+}
+
+// the map is applied to every frame, the pixels of the LEDs are rebuilt from the grid
+void Ledstrip::gather()
+{
+    const uint16_t* map = layout.index_map();
+    if(map == NULL || grid == NULL)
+        return;
+    color_t* px = led_strip_pixels;
+    for(uint32_t p=0; p<cfg.num_leds; p++)
+        px[p] = grid[map[p]];
+    behind = false;
+}
+
+// the effect did not draw this frame, or draws on top of the last one: the last frame is copied over
+void Ledstrip::catch_up()
+{
+    if(!behind)
+        return;
+    memcpy(pixel_buf[wire_buf], pixel_buf[wire_buf ^ 1], led_strip_size());
+    behind = false;
+}
+
+// called with the mutex held that the render task takes for this strip
+esp_err_t Ledstrip::apply_layout(esp_err_t ret)
+{
+    if(ret == ESP_OK)
+    {
+        new_grid();
+        char path[40];
+        side_path(path, sizeof(path), "map.bin");
+        layout.save(path);
+    }
+    return ret;
+}
+
+/* The LEDs are a matrix of width x height, wired row by row or column by column,
+ * starting in the corner given by the flags. width = 0: the LEDs are one row. */
+esp_err_t Ledstrip::set_matrix(uint16_t width, uint16_t height, uint32_t flags)
+{
+    xSemaphoreTake(render_mutex(), portMAX_DELAY);
+    esp_err_t ret = apply_layout(layout.set_matrix(width, height, flags));
+    xSemaphoreGive(render_mutex());
+    wake();
+    return ret;
+}
+
+// the cell of every LED from a point list, a text file with one "x,y" per LED
+esp_err_t Ledstrip::set_points(const char* path)
+{
+    xSemaphoreTake(render_mutex(), portMAX_DELAY);
+    esp_err_t ret = apply_layout(layout.load_points(path));
+    xSemaphoreGive(render_mutex());
+    wake();
+    return ret;
 }
 
 void Ledstrip::dark()
 {
     memset(led_strip_pixels, 0, led_strip_size());
+    ring_reset();
+    base_valid = false;
+}
+
+/* The pixels still hold the base pattern of a rotation-only effect, it only needs to be rotated.
+ * Marks the pattern as valid, the caller renders it if this returns false. */
+bool Ledstrip::base_cached()
+{
+    render_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.algo = cfg.algorithm;
+    key.num_leds = cfg.num_leds;
+    key.gradients = cfg.gradients;
+    if(effect(cfg.algorithm)->flags & EFFECT_STATIC)
+        key.color1 = cfg.color1;
+    if(base_valid && memcmp(&key, &base_key, sizeof(key)) == 0)
+        return true;
+
+    base_key = key;
+    base_valid = true;
+    return false;
 }
 
+// pixels are stored in logical order again
+void Ledstrip::ring_reset()
+{
+    ring_head = 0;
+    mirror = 0;
+}
+
+/* Rotate all pixels by one LED. The pixels stay in place, LED i shows pixel i - ring_head.
+ * The encoder folds ring_head into the offset. */
 void Ledstrip::walk()
 {
-    if(cfg.speed == 0)
-        return;
-        
-    int i = cfg.num_leds - 1;
-    color_t buf = led_strip_pixels[i];
+    if(mirror)
+        ring_reset();
 
-    for(i=cfg.num_leds-2; i>=0; i--)
+    ring_head = (ring_head + anim_steps) % cfg.num_leds;
+}
+
+/* Moves the animation by the time since the last frame. The speed sets the time per LED,
+ * (SPEED_MAX_VAL - speed)^2 ms, 0 stands still. Returns the whole LEDs moved,
+ * the fraction of the next one stays in anim_frac. */
+uint32_t Ledstrip::advance()
+{
+    int64_t now = esp_timer_get_time();
+    int64_t dt = anim_time ? now - anim_time : 0;
+    anim_time = now;
+    if(cfg.speed == 0 || cfg.speed > SPEED_MAX_VAL)
     {
-        led_strip_pixels[(i+1)] = led_strip_pixels[i];
+        anim_frac = 0;
+        return 0;
     }
-    led_strip_pixels[0] = buf;
+    if(dt > ANIM_MAX_GAP_US)
+        dt = ANIM_MAX_GAP_US;
+
+    int64_t step_us = (SPEED_MAX_VAL - cfg.speed) * (SPEED_MAX_VAL - cfg.speed) * 1000LL;
+    if(step_us < 1000)
+        step_us = 1000;
+    uint64_t pos = anim_frac + ((uint64_t)dt << 16) / step_us;
+    anim_frac = pos & 0xffff;
+    return pos >> 16;
 }
 
 void Ledstrip::firstled(color_t color)
 {
-    led_strip_pixels[0] = color;
+    led_strip_pixels[in_range(-(int)ring_head)] = color;
     cfg.gradients = 1;
+    base_valid = false;
 }
 
 string Ledstrip::to_json(led_config_t& cfg)
 {
+    string seg_list;
+    for(int i=0; i<nr_seg; i++)
+        seg_list += (i ? "," : "") + to_string(seg[i]->seg_len);
+
+    const layout_config_t& lc = layout.cfg;
+    string matrix;
+    if(lc.flags & LAYOUT_POINTS)
+        matrix = "points";
+    else if(lc.width)
+        matrix = to_string(lc.width) + "x" + to_string(lc.height);
+
     return "{" + 
         to_json("red", cfg.color1.red) + "," + 
         to_json("green", cfg.color1.green) + "," + 
@@ -210,7 +775,19 @@ string Ledstrip::to_json(led_config_t& cfg)
         to_json("led1", cfg.led1) + "," +
         to_json("rotate", (cfg.counterclock ? "left" : "right")) + "," +
         to_json("name", cfg.name) + "," +
-        to_json("fadein", cfg.fadein_ms) +
+        to_json("fadein", cfg.fadein_ms) + "," +
+        to_json("missed", missed_deadlines) + "," +
+        to_json("sent", frames_sent) + "," +
+        to_json("skipped", frames_skipped) + "," +
+        to_json("jitter", jitter_cnt ? jitter_sum / jitter_cnt : 0) + "," +
+        to_json("jitter_max", jitter_max) + "," +
+        to_json("gamma", cfg.gamma) + "," +
+        to_json("segments", seg_list) + "," +
+        to_json("matrix", matrix) + "," +
+        to_json("text", text) + "," +
+        to_json("wiring", (lc.flags & LAYOUT_SERPENTINE ? "zigzag" : "straight") + string(lc.flags & LAYOUT_COLUMNS ? "_cols" : "")) + "," +
+        to_json("origin", string(lc.flags & LAYOUT_BOTTOM ? "b" : "t") + (lc.flags & LAYOUT_RIGHT ? "r" : "l")) + "," +
+        to_json("white", (cfg.white.red << 16) | (cfg.white.green << 8) | cfg.white.blue) +
         "}";
 }
 
@@ -221,71 +798,333 @@ string Ledstrip::to_json(const string &tag, uint32_t nr)
 
 string Ledstrip::to_json(const string &tag, const string& str)
 {
-    return "\"" + tag + "\":" + "\"" + str + "\"";
+    // names and texts are typed in by the user
+    string esc;
+    for(char c : str)
+    {
+        if(c == '"' || c == '\\')
+            esc += '\\';
+        if((uint8_t)c >= ' ')
+            esc += c;
+    }
+    return "\"" + tag + "\":" + "\"" + esc + "\"";
+}
+
+void Ledstrip::wait_wire_done()
+{
+    // a segment is sent with its strip
+    if(parent)
+    {
+        parent->wait_wire_done();
+        return;
+    }
+    // the members send the canvas
+    for(int i=0; i<nr_members; i++)
+        member[i]->wait_wire_done();
+
+    // take and give back the frame that was sent last, so the RMT does not read any of them
+    int sent = wire_buf ^ 1;
+    while(!xSemaphoreTake(wire_free[sent], pdMS_TO_TICKS(PERIOD_SECOND)))
+        ESP_LOGW(TAG, "GPIO %d: frame still on the wire", gpio_nr);
+    xSemaphoreGive(wire_free[sent]);
 }
 
 void Ledstrip::new_led_strip_pixels(uint32_t nr_leds)
 {
-    if(led_strip_pixels)
-        delete led_strip_pixels;
+    wait_wire_done();
 
-    if(rmt_pixels)
-        delete rmt_pixels;
+    if(parent)
+    {
+        // the pixels of a segment are a slice of the strip, its length is given by the strip
+        if(heat)
+            delete[] heat;
+        heat = NULL;
+        cfg.num_leds = nr_leds ? seg_len : 0;
+        sync_slice();
+        base_valid = false;
+        new_grid();
+        return;
+    }
+
+    for(int b=0; b<2; b++)
+    {
+        if(pixel_buf[b])
+            delete[] pixel_buf[b];
+        pixel_buf[b] = NULL;
+        wire_frame[b].pixels = NULL;
+    }
+    if(heat)
+        delete[] heat;
+    heat = NULL;
+    xfade = false;
+    xfade_free();
 
     if(nr_leds > 0)
     {
-        led_strip_pixels = new color_t[nr_leds];
-        rmt_pixels = new uint8_t[nr_leds*3];
+        for(int b=0; b<2; b++)
+            pixel_buf[b] = new color_t[nr_leds];
     }
+    led_strip_pixels = pixel_buf[wire_buf];
+    sent_valid = false;
+    behind = false;
+    base_valid = false;
     cfg.num_leds = nr_leds;
+    for(int i=0; i<nr_seg; i++)
+        seg[i]->sync_slice();
+    new_grid();
     ESP_LOGI(TAG, "Nr. LEDs: %d", cfg.num_leds);
 }
 
-void vLedstripTask( void * pvParameters )
+// a segment renders into the frame of its strip, follow the strip to its current frame
+void Ledstrip::sync_slice()
 {
-    Ledstrip* ls = (Ledstrip*)pvParameters;
-    ls->loop();
+    for(int b=0; b<2; b++)
+        pixel_buf[b] = parent->pixel_buf[b] ? parent->pixel_buf[b] + seg_start : NULL;
+    wire_buf = parent->wire_buf;
+    led_strip_pixels = pixel_buf[wire_buf];
+    sent_valid = parent->sent_valid;
+    last_sent = parent->last_sent;
 }
 
-esp_err_t Ledstrip::init(const char *spiffs_path, RmtTxDriver* rmt_inst, gpio_num_t gpionr)
+/* Split the strip into segments of the given lengths, starting at the first LED.
+ * Every segment has its own config and effect, LEDs behind the last one stay dark.
+ * n = 0 removes all segments. */
+esp_err_t Ledstrip::set_segments(const uint32_t* len, int n)
+{
+    if(parent || n < 0 || n > LED_MAX_SEGMENTS)
+        return ESP_ERR_INVALID_ARG;
+    if(canvas)
+    {
+        // not rendered by the scheduler meanwhile, its pixels are a slice of the canvas
+        ESP_LOGE(TAG, "GPIO %d: a strip of the canvas can not have segments", gpio_nr);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    bool same = (n == nr_seg);
+    for(int i=0; same && i<n; i++)
+        same = (len[i] == seg[i]->seg_len);
+    if(same)
+        return ESP_OK;
+
+    uint32_t total = 0;
+    for(int i=0; i<n; i++)
+    {
+        total += len[i];
+        if(len[i] == 0 || total > cfg.num_leds)
+        {
+            ESP_LOGE(TAG, "GPIO %d: segments do not fit into %d LEDs", gpio_nr, cfg.num_leds);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    xSemaphoreTake(seg_mutex, portMAX_DELAY);
+    // the RMT may still read the frames of the old segments
+    wait_wire_done();
+    // deleted once the mutex is given, ~Ledstrip writes a pending config and that takes it
+    Ledstrip* old_seg[LED_MAX_SEGMENTS];
+    int nr_old = nr_seg;
+    memcpy(old_seg, seg, sizeof(Ledstrip*) * nr_seg);
+    nr_seg = 0;
+
+    uint32_t start = 0;
+    int path_len = strlen(cfgfile_path) - 4;    // without ".bin"
+    for(int i=0; i<n; i++)
+    {
+        Ledstrip* s = new Ledstrip();
+        s->parent = this;
+        s->seg_start = start;
+        s->seg_len = len[i];
+        s->gpio_nr = gpio_nr;
+        s->saver = saver;
+        s->seed(esp_random());
+        snprintf(s->cfgfile_path, sizeof(s->cfgfile_path), "%.*s_%d.bin", path_len, cfgfile_path, i);
+        s->restoreConfig();
+        seg[nr_seg++] = s;
+        start += len[i];
+    }
+    sent_valid = false;
+    xSemaphoreGive(seg_mutex);
+    for(int i=0; i<nr_old; i++)
+        delete old_seg[i];
+
+    char path[40];
+    snprintf(path, sizeof(path), "%.*s_seg.bin", path_len, cfgfile_path);
+    FILE* f = fopen(path, "w");
+    if(f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s for writing", path);
+    }
+    else
+    {
+        if(fwrite(len, sizeof(uint32_t), n, f) != n)
+            ESP_LOGE(TAG, "Failed to write to %s: %s", path, strerror(errno));
+        fclose(f);
+    }
+
+    if(sched)
+        sched->wake(this);
+    return ESP_OK;
+}
+
+/* Render one effect over the strips, in this order, as if they were one strip.
+ * Only for the Ledstrip without GPIO. The strips keep their own led1, direction and output tables.
+ * n = 0 gives all strips back their own effects. */
+esp_err_t Ledstrip::set_canvas(Ledstrip* const* strips, int n)
+{
+    if(gpio_nr != GPIO_NUM_NC || n < 0 || n > LED_MAX_CANVAS)
+        return ESP_ERR_INVALID_ARG;
+    for(int i=0; i<n; i++)
+    {
+        if(strips[i]->nr_seg > 0 || strips[i]->parent || strips[i] == this)
+        {
+            ESP_LOGE(TAG, "strip with segments can not be part of the canvas");
+            return ESP_ERR_INVALID_ARG;
+        }
+        // a strip joins once, leaving twice would free its pixels twice
+        for(int j=0; j<i; j++)
+        {
+            if(strips[j] == strips[i])
+            {
+                ESP_LOGE(TAG, "strip is part of the canvas twice");
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+    }
+
+    xSemaphoreTake(seg_mutex, portMAX_DELAY);
+    for(int i=0; i<nr_members; i++)
+        member[i]->leave_canvas();
+    nr_members = 0;
+    for(int b=0; b<2; b++)
+    {
+        if(phys[b])
+            delete[] phys[b];
+        phys[b] = NULL;
+    }
+
+    uint32_t total = 0;
+    for(int i=0; i<n; i++)
+        total += strips[i]->cfg.num_leds;
+    new_led_strip_pixels(total);
+    if(total > 0)
+    {
+        for(int b=0; b<2; b++)
+        {
+            phys[b] = new color_t[total];
+            memset(phys[b], 0, total * sizeof(color_t));
+        }
+    }
+    phys_buf = 0;
+
+    uint32_t start = 0;
+    for(int i=0; i<n; i++)
+    {
+        strips[i]->join_canvas(this, start);
+        member[nr_members++] = strips[i];
+        start += strips[i]->cfg.num_leds;
+    }
+    sent_valid = false;
+    xSemaphoreGive(seg_mutex);
+
+    if(sched)
+        sched->wake(this);
+    return ESP_OK;
+}
+
+// the strip shows its slice of the canvas instead of its own effect
+void Ledstrip::join_canvas(Ledstrip* c, uint32_t start)
+{
+    xSemaphoreTake(seg_mutex, portMAX_DELAY);
+    if(sched)
+        sched->remove(this);
+    wait_wire_done();
+    // pixel_buf[wire_buf] must be the phys buffer the canvas renders now, both flip with every frame
+    for(int b=0; b<2; b++)
+    {
+        own_buf[b] = pixel_buf[b];
+        pixel_buf[b] = c->phys[b ^ wire_buf ^ c->phys_buf] + start;
+    }
+    led_strip_pixels = pixel_buf[wire_buf];
+    canvas = c;
+    xfade = false;
+    sent_valid = false;
+    behind = false;
+    xSemaphoreGive(seg_mutex);
+}
+
+void Ledstrip::leave_canvas()
+{
+    xSemaphoreTake(seg_mutex, portMAX_DELAY);
+    wait_wire_done();
+    for(int b=0; b<2; b++)
+        pixel_buf[b] = own_buf[b];
+    led_strip_pixels = pixel_buf[wire_buf];
+    canvas = NULL;
+    sent_valid = false;
+    base_valid = false;
+    behind = false;
+    xSemaphoreGive(seg_mutex);
+    if(sched)
+        sched->add(this);
+}
+
+void Ledstrip::restoreSegments()
+{
+    char path[40];
+    snprintf(path, sizeof(path), "%.*s_seg.bin", (int)strlen(cfgfile_path) - 4, cfgfile_path);
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+        return;
+
+    uint32_t len[LED_MAX_SEGMENTS];
+    int n = fread(len, sizeof(uint32_t), LED_MAX_SEGMENTS, f);
+    fclose(f);
+    if(n > 0)
+        set_segments(len, n);
+}
+
+esp_err_t Ledstrip::init(const char *spiffs_path, RmtTxDriver* rmt_inst, RenderScheduler* sched_inst, ConfigSaver* saver_inst, gpio_num_t gpionr)
 {
     rmt = rmt_inst;
+    saver = saver_inst;
     gpio_nr = gpionr;
-    snprintf(cfgfile_path, sizeof(cfgfile_path), "%s/config%d.bin", spiffs_path, gpionr);
+    seed(esp_random());
+    if(gpionr == GPIO_NUM_NC)
+        snprintf(cfgfile_path, sizeof(cfgfile_path), "%s/canvas.bin", spiffs_path);
+    else
+        snprintf(cfgfile_path, sizeof(cfgfile_path), "%s/config%d.bin", spiffs_path, gpionr);
     restoreConfig();
+    restoreSegments();
 
-    BaseType_t xReturned;
-    TaskHandle_t xHandle = NULL;
-
-    /* Create the task, storing the handle. */
-    xReturned = xTaskCreate(
-                    vLedstripTask    ,       /* Function that implements the task. */
-                    "LedstripTask",          /* Text name for the task. */
-                    STACK_SIZE,      /* Stack size in words, not bytes. */
-                    this,    /* Parameter passed into the task. */
-                    1,      /* Priority at which the task is created. */
-                    &xHandle );      /* Used to pass out the created task's handle. */
-
-    if( xReturned != pdPASS )
+    startTime = xTaskGetTickCount();
+    if(sched_inst->add(this) != ESP_OK)
     {
-        ESP_LOGE(TAG, "could not create a task for ledstrip at GPIO %d", gpionr);
+        ESP_LOGE(TAG, "could not schedule ledstrip at GPIO %d", gpionr);
         return ESP_FAIL;
     }
+    sched = sched_inst;
+    ESP_LOGI(TAG, "scheduled LED strip at GPIO %d", gpio_nr);
     return ESP_OK;
 }
 
 void Ledstrip::monocolor()
 {
     //ESP_LOGI(TAG, "R=%d G=%d B=%d", cfg.red, cfg.green, cfg.blue);
-    for (int j = 0; j < cfg.num_leds; j ++) 
-    {
-        led_strip_pixels[j] = cfg.color1;
-    }
+    if(base_cached())
+        return;
+
+    color_t color = cfg.color1;
+    fill([color](uint32_t j) { return color; });
 }
 
 
 void Ledstrip::add_gradient(color_t color)
 {
+    if(cfg.gradients >= GRADIENT_MAX_STOPS)
+    {
+        ESP_LOGW(TAG, "no more than %d gradient stops", GRADIENT_MAX_STOPS);
+        return;
+    }
     for(int g=1; g<cfg.gradients-1; g++)
     {
         int a = cfg.num_leds * g / cfg.gradients;
@@ -299,35 +1138,213 @@ void Ledstrip::add_gradient(color_t color)
     }
     cfg.gradients++;
     led_strip_pixels[cfg.num_leds * (cfg.gradients - 1) / cfg.gradients] = color;
+    base_valid = false;
+}
+
+void Ledstrip::seed(uint32_t s)
+{
+    // xorshift must not start at 0
+    rng_state = s ? s : 1;
+}
+
+uint8_t Ledstrip::random8()
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x >> 24;
+}
+
+// 0 ... lim - 1
+uint8_t Ledstrip::random8(uint8_t lim)
+{
+    return (random8() * lim) >> 8;
 }
 
 uint8_t Ledstrip::colorchange1(uint8_t ledcol)
 {
-    return ledcol * (rand() % 256) / 256;
+    return ledcol * random8() / 256;
 }
 
+/* The first num_leds/2 + 1 pixels are a ring of colors, the newest one at ring_head.
+ * The encoder shows them mirrored around the center, moving outwards. */
 void Ledstrip::belt()
 {
-    for(int i=0; i<(cfg.num_leds+1)/2 + 1; i++)
+    uint32_t m = cfg.num_leds/2;
+    if(mirror != m)
+        ring_head = 0;
+    mirror = m;
+    // one new color per LED step, the older ones move outwards
+    uint32_t steps = anim_steps < m + 1 ? anim_steps : m + 1;
+    for(uint32_t s=0; s<steps; s++)
     {
-        led_strip_pixels[i] = led_strip_pixels[i+1];
-        led_strip_pixels[cfg.num_leds - i] = led_strip_pixels[i];
+        ring_head = (ring_head + m) % (m + 1);
+        led_strip_pixels[ring_head].red = colorchange1(cfg.color1.red);
+        led_strip_pixels[ring_head].green = colorchange1(cfg.color1.green);
+        led_strip_pixels[ring_head].blue = colorchange1(cfg.color1.blue);
     }
-    int m = cfg.num_leds/2;
-    led_strip_pixels[m].red = colorchange1(cfg.color1.red);
-    led_strip_pixels[m].green = colorchange1(cfg.color1.green);
-    led_strip_pixels[m].blue = colorchange1(cfg.color1.blue);
     startled = cfg.led1;
 }
 
+// black - red - yellow - white
+static color_t heat_color(uint8_t temperature)
+{
+    color_t c;
+    uint8_t t192 = temperature * 191 / 255;
+    uint8_t ramp = (t192 & 0x3f) << 2;
+    if(t192 & 0x80)
+        c = { 255, 255, ramp };
+    else if(t192 & 0x40)
+        c = { ramp, 255, 0 };
+    else
+        c = { 0, ramp, 0 };
+    return c;
+}
+
+/* Heat diffusion fire, after Fire2012 by Mark Kriegsman:
+ * cells cool down, heat rises and diffuses, sparks ignite at the bottom. */
+void Ledstrip::fire_step()
+{
+    uint32_t n = cfg.num_leds;
+    // short strips cool more, at most 255 as random8() takes a byte
+    uint32_t cool = (FIRE_COOLING * 10) / n + 2;
+    uint8_t cooling = cool > 255 ? 255 : cool;
+    for(uint32_t i=0; i<n; i++)
+    {
+        uint8_t c = random8(cooling);
+        heat[i] = heat[i] > c ? heat[i] - c : 0;
+    }
+
+    for(uint32_t k=n-1; k>=2; k--)
+        heat[k] = (heat[k - 1] + heat[k - 2] + heat[k - 2]) / 3;
+
+    if(random8() < FIRE_SPARKING)
+    {
+        uint32_t y = random8(n < FIRE_SPARK_LEDS ? n : FIRE_SPARK_LEDS);
+        uint32_t h = heat[y] + 160 + random8(96);
+        heat[y] = h > 255 ? 255 : h;
+    }
+}
+
 void Ledstrip::fire()
 {
-    for(int i=0; i<cfg.num_leds; i++)
+    static color_t palette[256];
+    if(palette[255].red == 0)
     {
-        led_strip_pixels[i].red = 127 + rand() % 128;
-        led_strip_pixels[i].green = 33 + rand() % 66;
-        led_strip_pixels[i].blue = 0;
+        for(int t=0; t<256; t++)
+            palette[t] = heat_color(t);
     }
+
+    uint32_t n = cfg.num_leds;
+    if(n == 0)
+        return;
+    if(heat == NULL)
+    {
+        heat = new uint8_t[n];
+        memset(heat, 0, n);
+    }
+
+    // one simulation step per LED step of the speed
+    uint32_t steps = anim_steps < FIRE_MAX_STEPS ? anim_steps : FIRE_MAX_STEPS;
+    for(uint32_t s=0; s<steps; s++)
+        fire_step();
+
+    const uint8_t* h = heat;
+    fill([h](uint32_t j) { return palette[h[j]]; });
+}
+
+// 128 + 127 * sin(2 pi i / 256)
+static uint8_t sin8(uint8_t i)
+{
+    static uint8_t table[256];
+    if(table[64] == 0)
+    {
+        for(int k=0; k<256; k++)
+            table[k] = 128 + lroundf(127 * sinf(k * 2 * (float)M_PI / 256));
+    }
+    return table[i];
+}
+
+/* Plasma over the grid of the layout, three waves across x, y and the diagonal.
+ * One LED step of the speed moves the waves by 1/16 of their length. */
+void Ledstrip::plasma()
+{
+    uint32_t w = layout.grid_width();
+    uint32_t h = layout.grid_height();
+    if(grid == NULL || w == 0)
+        return;
+
+    uint32_t t = (anim_pos << 4) + (anim_frac >> 12);
+    fill2d([w, h, t](uint32_t x, uint32_t y) {
+        uint32_t u = x * 256 / w;
+        uint32_t v = y * 256 / h;
+        uint32_t sum = sin8(u + t) + sin8(v + t * 3 / 4) + sin8((u + v) / 2 - t / 2);
+        return led_strip_hsv2rgb(sum * HSV_HUE_STEPS / 766 + t, 255, 255);
+    });
+}
+
+// columns of the text in the font, followed by a gap so the text scrolls out before it comes in again
+void Ledstrip::rasterize(const string& s, uint32_t width)
+{
+    if(text_cols)
+        delete[] text_cols;
+    text_len = s.size() * (FONT_WIDTH + 1) + width;
+    text_cols = new uint8_t[text_len];
+    memset(text_cols, 0, text_len);
+
+    uint8_t* col = text_cols;
+    for(char ch : s)
+    {
+        if(ch < FONT_FIRST || ch > FONT_LAST)
+            ch = '?';
+        memcpy(col, font5x7[ch - FONT_FIRST], FONT_WIDTH);
+        col += FONT_WIDTH + 1;
+    }
+    text_shown = s;
+    text_width = width;
+}
+
+/* Scrolls the text through the grid, one column per LED step of the speed.
+ * Without a text it shows the time of day, "--:--" until the clock is set. */
+void Ledstrip::ticker()
+{
+    uint32_t w = layout.grid_width();
+    uint32_t h = layout.grid_height();
+    if(grid == NULL || w == 0)
+        return;
+
+    string s = text;
+    if(s.empty())
+    {
+        timesvc_t t;
+        timesvc_get(&t);
+        char buf[8] = "--:--";
+        if(t.valid)
+            snprintf(buf, sizeof(buf), "%02d:%02d", t.local.tm_hour, t.local.tm_min);
+        s = buf;
+    }
+    // the font is only rasterized when the text changes
+    if(s != text_shown || w != text_width)
+        rasterize(s, w);
+
+    const uint8_t* cols = text_cols;
+    uint32_t len = text_len;
+    uint32_t start = anim_pos % len;
+    int32_t top = ((int32_t)h - FONT_HEIGHT) / 2;
+    color_t fg = cfg.color1;
+    color_t bg = { 0, 0, 0 };
+    fill2d([=](uint32_t x, uint32_t y) {
+        int32_t row = (int32_t)y - top;
+        if(row < 0 || row >= FONT_HEIGHT)
+            return bg;
+        // len > w, the window wraps around at most once
+        uint32_t c = start + x;
+        if(c >= len)
+            c -= len;
+        return ((cols[c] >> row) & 1) ? fg : bg;
+    });
 }
 
 uint8_t Ledstrip::get_gradient(uint8_t color1, uint8_t color2, int a, int b, int i)
@@ -351,6 +1368,11 @@ int Ledstrip::in_range(int lednr)
 
 void Ledstrip::gradient()
 {
+    startled = (startled + anim_steps) % cfg.num_leds;
+
+    if(base_cached())
+        return;
+
     int gradients = cfg.gradients;
     if(gradients < 2)
         gradients = 2;
@@ -366,135 +1388,413 @@ void Ledstrip::gradient()
             led_strip_pixels[i].blue = get_gradient(led_strip_pixels[b % cfg.num_leds].blue, led_strip_pixels[a].blue, a, b, i);
         }
     }
-
-    if(cfg.speed > 0)
-        startled = (startled + 1) % cfg.num_leds;   
 }
 
 void Ledstrip::rainbow()
 {
-    uint16_t hue = 0;
-    uint32_t red, green, blue;
-    
-    for (int j = 0; j < cfg.num_leds; j ++) 
-    {
-        hue = (cfg.num_leds + j) % cfg.num_leds * 360 / cfg.num_leds;
-        led_strip_hsv2rgb(hue, 100, 100, &red, &green, &blue);
-        led_strip_pixels[j].green = green * cfg.bright / 100;
-        led_strip_pixels[j].red = red * cfg.bright / 100;
-        led_strip_pixels[j].blue = blue * cfg.bright / 100;
-    }
+    startled = (startled + anim_steps) % cfg.num_leds;
+
+    if(base_cached())
+        return;
     
-    if(cfg.speed > 0)
-        startled = (startled + 1) % cfg.num_leds;    
+    uint32_t n = cfg.num_leds;
+    fill([n](uint32_t j) { return led_strip_hsv2rgb(j * HSV_HUE_STEPS / n, 255, 255); });
 }
 
 void Ledstrip::rainbow_clock()
 {
-    uint16_t hue = 0;
-    uint32_t red, green, blue;
+    timesvc_t t;
+    timesvc_get(&t);
 
-    time_t now;
-    struct tm timeinfo;
-    char strftime_buf[64];
-    time(&now);
+    uint32_t hue = HSV_HUE_STEPS - 1 - (t.sec * HSV_HUE_STEPS / (24*60*60) % HSV_HUE_STEPS);
+    color_t color = led_strip_hsv2rgb(hue, 255, 255);
+    fill([color](uint32_t j) { return color; });
+}
 
-    localtime_r(&now, &timeinfo);
-    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    //ESP_LOGI(TAG, "%s hue %d", strftime_buf, hue);
+// hour markers of clock2, they only depend on the number of LEDs
+void Ledstrip::build_face()
+{
+    if(face)
+        delete[] face;
+    uint32_t n = cfg.num_leds;
+    face = new uint8_t[n];
+    face_leds = n;
+    memset(face, 0, n);
+    if(n < 60)
+        return;
 
-    hue = 359 - (now * 360 / (24*60*60) % 360);
-    led_strip_hsv2rgb(hue, 100, cfg.bright, &red, &green, &blue);
-    
-    for (int j = 0; j < cfg.num_leds; j ++) 
+    for (int i = 0; i < 12; i++)
     {
-        led_strip_pixels[j].green = green;
-        led_strip_pixels[j].red = red;
-        led_strip_pixels[j].blue = blue;
+        // 12 o'clock is widest, 3, 6 and 9 are wider than the others
+        int w;
+        if(i == 0)
+            w = 2;
+        else if(i % 3 == 0)
+            w = 1;
+        else
+            w = 0;
+
+        for (int k = -w; k <= w; k ++)
+            face[in_range(n * i / 12 + k)] = 1;
     }
 }
 
 void Ledstrip::clock2()
 {
-    time_t now;
-    struct tm timeinfo;
-    char strftime_buf[64];
-    uint16_t hue = 0;
-    uint32_t red, green, blue;
-    struct timeval tv_now;
+    timesvc_t t;
+    timesvc_get(&t);
+    if(face == NULL || face_leds != cfg.num_leds)
+        build_face();
+
+    uint32_t n = cfg.num_leds;
+    uint32_t hue = HSV_HUE_STEPS - 1 - (t.sec * HSV_HUE_STEPS / (24*60*60) % HSV_HUE_STEPS);
+    color_t minutecolor = led_strip_hsv2rgb(hue, 255, 13);
+    color_t marker = cfg.color2;
+    color_t black = { 0, 0, 0 };
+    uint32_t minuteleds = n * t.local.tm_min / 60;
+    const uint8_t* f = face;
+    fill([=](uint32_t j) { return f[j] ? marker : (j < minuteleds ? minutecolor : black); });
+
+    uint32_t hourleds = n * ((t.local.tm_hour%12) * 60 + t.local.tm_min) / (12*60);
+    color_t hourcolor = led_strip_hsv2rgb(hue + HSV_HUE_STEPS / 2, 255, 255);
+    for (int i = -CLOCK_HOUR_WIDTH; i <= CLOCK_HOUR_WIDTH; i ++)
+    {
+        led_strip_pixels[in_range(hourleds + i)] = hourcolor;
+    }
+
+    uint32_t secleds = n * (t.local.tm_sec * 1000 + t.ms) / 60000;
+    led_strip_pixels[secleds] = cfg.color1;
+    startled = cfg.led1;
+}
 
-    time(&now);
-    gettimeofday(&tv_now, NULL);
-    localtime_r(&now, &timeinfo);
-    if(lastSec != timeinfo.tm_sec)
+void Ledstrip::switchLeds()
+{
+    if(cfg.num_leds == 0)
+        return;
+
+    const ledfunc_table_t* fx = effect(cfg.algorithm);
+    // only the shifting effects keep their pixels in a ring
+    if(!(fx->flags & EFFECT_RING))
+        ring_reset();
+    // other effects overwrite the cached pattern
+    if(!(fx->flags & (EFFECT_ROTATE | EFFECT_STATIC)))
+        base_valid = false;
+
+    // SNTP may have moved the clock, blend over to the new time
+    if(fx->flags & EFFECT_TIMED)
     {
-        strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-        //ESP_LOGI(TAG, "%s", strftime_buf);
-        lastSec = timeinfo.tm_sec;
+        uint32_t gen = timesvc_sync_gen();
+        if(gen != time_gen && fx->algo == shown_algo && XFADE_US > 0 && cfg.power && !parent && gpio_nr != GPIO_NUM_NC)
+            xfade_begin();
+        time_gen = gen;
     }
-    
-    dark();
-    
-    hue = 359 - (now * 360 / (24*60*60) % 360);
-    led_strip_hsv2rgb(hue, 100, 5, &red, &green, &blue);
-    
-    uint32_t minuteleds = cfg.num_leds * timeinfo.tm_min / 60;
-    for (int j = 0; j < minuteleds; j ++)
+
+    if(fx->algo != shown_algo)
     {
-        led_strip_pixels[j].green = green;
-        led_strip_pixels[j].red = red;
-        led_strip_pixels[j].blue = blue;
+        // a segment is sent with its strip and the canvas by its members, they cut over
+        if(shown_algo != ALGO_END && XFADE_US > 0 && cfg.power && !parent && gpio_nr != GPIO_NUM_NC)
+            xfade_begin();
+        shown_algo = fx->algo;
     }
 
-    if(cfg.num_leds >= 60)
+    // the grid only takes RAM while a 2D effect is shown
+    if(((fx->flags & EFFECT_2D) != 0) != layout.used())
+        new_grid();
+
+    anim_steps = advance();
+    anim_pos += anim_steps;
+    if(fx->flags & EFFECT_KEEPS)
+        catch_up();
+    if(fx->func)
+        fx->func(this);
+    // the others draw every LED, a 2D effect in gather()
+    if(!(fx->flags & (EFFECT_KEEPS | EFFECT_2D)))
+        behind = false;
+}
+
+/* Build the output tables from gamma, white point, brightness and fade step.
+ * Only done if one of them changed since the table was built.
+ * The gamma curve is kept, a fade step only scales it again. */
+void Ledstrip::update_lut(output_lut_t* lut, uint16_t scale)
+{
+    output_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.bright = cfg.bright > 100 ? 100 : cfg.bright;
+    param.gamma = cfg.gamma;
+    param.white = cfg.white;
+    param.scale = scale;
+    if(memcmp(&param, &lut->param, sizeof(param)) == 0)
+        return;
+
+    if(gamma_curve_of != cfg.gamma)
     {
-        for (int i = 0; i < 12; i++)
+        float gamma = cfg.gamma / 10.0f;
+        for(int v=0; v<256; v++)
         {
-            int w;
-            if(i == 0)
-                w = 2;
-            else if(i % 3 == 0)
-                w = 1;
-            else
-                w = 0;
-
-            for (int n = -w; n <= w; n ++)
-            {
-                int l = cfg.num_leds * i / 12 + n;
-                led_strip_pixels[in_range(l)] = cfg.color2;
-            }
+            uint32_t g = v;
+            if(cfg.gamma != 10)
+                g = powf(v / 255.0f, gamma) * 255.0f + 0.5f;
+            gamma_curve[v] = g;
         }
+        gamma_curve_of = cfg.gamma;
     }
 
-    uint32_t hourleds = cfg.num_leds * ((timeinfo.tm_hour%12) * 60 + timeinfo.tm_min) / (12*60);
-    led_strip_hsv2rgb(hue + 180, 100, 100, &red, &green, &blue);
-    for (int i = -1; i <= 1; i ++)
+    const uint8_t white[3] = { cfg.white.green, cfg.white.red, cfg.white.blue };
+    for(int c=0; c<3; c++)
     {
-        int l = in_range(hourleds + i);
-        led_strip_pixels[l].green = green;
-        led_strip_pixels[l].red = red;
-        led_strip_pixels[l].blue = blue;
+        uint32_t k = white[c] * param.bright * scale;
+        for(int v=0; v<256; v++)
+            lut->table[c][v] = gamma_curve[v] * k / (255 * 100 * 256);
     }
+    lut->param = param;
+}
 
-    uint32_t secleds = cfg.num_leds * ((tv_now.tv_sec % 60) * 1000 + tv_now.tv_usec / 1000) / 60000;
-    led_strip_pixels[secleds] = cfg.color1;
-    startled = cfg.led1;
+// the table maps every color to 0
+static bool lut_dark(const output_param_t& param)
+{
+    return param.scale == 0 || param.bright == 0;
 }
 
-void Ledstrip::switchLeds()
+/* Number of physical LEDs that must be sent, up to the last one that changed since the last frame sent.
+ * The LEDs behind it latched the same colors before. 0 if nothing changed. */
+uint32_t Ledstrip::changed_prefix(const led_strip_frame_t* frame)
 {
-    if(cfg.num_leds == 0)
+    uint32_t n = frame->num_leds;
+    if(!sent_valid)
+        return n;
+
+#if CONFIG_LED_KEEPALIVE_MS > 0
+    if(xTaskGetTickCount() - last_sent >= pdMS_TO_TICKS(CONFIG_LED_KEEPALIVE_MS))
+        return n;
+#endif
+
+    int sent = wire_buf ^ 1;
+    // dark now and in the last frame sent, even if the effect keeps moving in the pixels
+    if(lut_dark(out_lut[sent].param) && lut_dark(out_lut[wire_buf].param))
+        return 0;
+
+    const led_strip_frame_t* last = &wire_frame[sent];
+    if(last->num_leds != n ||
+       last->offset != frame->offset ||
+       last->reverse != frame->reverse ||
+       last->mirror != frame->mirror ||
+       last->ring != frame->ring ||
+       last->frac != frame->frac ||
+       last->wrap != frame->wrap ||
+       memcmp(&out_lut[sent].param, &out_lut[wire_buf].param, sizeof(output_param_t)) != 0)
+        return n;
+
+    // a blended LED also changes with the pixel before it, the walk below only looks at its own
+    if(frame->frac)
+        return n;
+
+    // a blended frame is not in pixel_buf
+    if(last->pixels != (const uint8_t*)pixel_buf[sent] || frame->pixels != (const uint8_t*)pixel_buf[wire_buf])
+        return n;
+
+    // walk the physical LEDs backwards, stop at the first difference
+    const color_t* a = pixel_buf[sent];
+    const color_t* b = pixel_buf[wire_buf];
+    uint32_t i = in_range(n - 1 - frame->offset);
+    for(uint32_t p=n; p>0; p--)
+    {
+        uint32_t j = led_strip_pixel_index(frame, i);
+        if(memcmp(&a[j], &b[j], sizeof(color_t)) != 0)
+            return p;
+        i = (i == 0) ? n - 1 : i - 1;
+    }
+    return 0;
+}
+
+// dst = a + (b - a) * t / 256, plain byte loop the compiler can vectorize
+static void lerp8(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t len, uint32_t t)
+{
+    uint16_t wa = 256 - t;
+    uint16_t wb = t;
+    for(size_t i=0; i<len; i++)
+        dst[i] = (a[i] * wa + b[i] * wb) >> 8;
+}
+
+// the pixels in the order the encoder sends them, before the output tables, at most max_leds of them
+void Ledstrip::to_physical(const led_strip_frame_t* frame, color_t* out, uint32_t max_leds)
+{
+    const color_t* px = (const color_t*)frame->pixels;
+    uint32_t n = frame->num_leds;
+    uint32_t count = n < max_leds ? n : max_leds;
+    uint32_t i = in_range(-(int)frame->offset);
+    for(uint32_t p=0; p<count; p++)
+    {
+        out[p] = px[led_strip_pixel_index(frame, i)];
+        if(frame->frac && (i || frame->wrap))
+        {
+            const color_t* prev = &px[led_strip_pixel_index(frame, i ? i - 1 : n - 1)];
+            lerp8((uint8_t*)&out[p], (const uint8_t*)&out[p], (const uint8_t*)prev, sizeof(color_t), frame->frac);
+        }
+        i = (i + 1 == n) ? 0 : i + 1;
+    }
+}
+
+// copy of the frame just queued for the preview, only when it asks for one and never waiting for it
+void Ledstrip::tap_preview(const led_strip_frame_t* frame)
+{
+    PixelPreview* p = preview;
+    if(p == NULL)
+        return;
+    color_t* dst = (color_t*)p->begin_capture();
+    if(dst == NULL)
         return;
 
-    for(int i=0; ledfunc_table[i].algo != ALGO_END; i++)
+    // the frames of the segments follow each other on the wire
+    uint32_t n = 0;
+    for(const led_strip_frame_t* f = frame; f && n < PREVIEW_MAX_LEDS; f = f->next)
     {
-        if(cfg.algorithm == ledfunc_table[i].algo)
+        to_physical(f, dst + n, PREVIEW_MAX_LEDS - n);
+        n += f->num_leds < PREVIEW_MAX_LEDS - n ? f->num_leds : PREVIEW_MAX_LEDS - n;
+    }
+    p->end_capture(n);
+}
+
+/* Keep the last frame sent as start of a cross-fade to the effect rendered next.
+ * Its buffer is not touched before the next transmit(). */
+void Ledstrip::xfade_begin()
+{
+    const led_strip_frame_t* last = &wire_frame[wire_buf ^ 1];
+    if(last->pixels == NULL || last->num_leds != cfg.num_leds)
+        return;
+
+    if(xfade_from == NULL)
+    {
+        // one block for the three frames, without it the effect just cuts over
+        xfade_from = new (std::nothrow) color_t[3 * cfg.num_leds];
+        if(xfade_from == NULL)
         {
-            ledfunc_table[i].func(this);
-            break;
+            ESP_LOGW(TAG, "GPIO %d: no memory to cross-fade", gpio_nr);
+            return;
         }
+        for(int b=0; b<2; b++)
+            xfade_out[b] = xfade_from + (b + 1) * cfg.num_leds;
     }
-    transmit();
+    to_physical(last, xfade_from);
+    xfade_start = esp_timer_get_time();
+    xfade = true;
+}
+
+void Ledstrip::xfade_free()
+{
+    if(xfade_from)
+        delete[] xfade_from;
+    xfade_from = NULL;
+    xfade_out[0] = NULL;
+    xfade_out[1] = NULL;
+}
+
+// fills the frame of the pixels rendered now
+led_strip_frame_t* Ledstrip::prepare_frame(uint16_t scale)
+{
+    update_lut(&out_lut[wire_buf], scale);
+
+    if(canvas)
+    {
+        // a slice of the canvas, already rendered in physical order
+        led_strip_frame_t* frame = &wire_frame[wire_buf];
+        memset(frame, 0, sizeof(*frame));
+        frame->pixels = (const uint8_t*)led_strip_pixels;
+        frame->num_leds = cfg.num_leds;
+        frame->offset = cfg.led1 % cfg.num_leds;
+        frame->reverse = cfg.counterclock;
+        frame->lut = out_lut[wire_buf].table;
+        return frame;
+    }
+
+    led_strip_frame_t* frame = &wire_frame[wire_buf];
+    if(effect(cfg.algorithm)->flags & EFFECT_2D)
+    {
+        // the layout maps the grid to the LEDs, in the order they are wired
+        gather();
+        catch_up();
+        frame->pixels = (const uint8_t*)led_strip_pixels;
+        frame->num_leds = cfg.num_leds;
+        frame->offset = 0;
+        frame->reverse = false;
+        frame->mirror = 0;
+        frame->ring = 0;
+        frame->frac = 0;
+        frame->wrap = false;
+        frame->lut = out_lut[wire_buf].table;
+        frame->next = NULL;
+        return frame;
+    }
+
+    // a frame sent again while fading, the effect did not draw it
+    catch_up();
+
+    // rotation, direction, ring and the output tables are applied by the encoder while sending
+    frame->pixels = (const uint8_t*)led_strip_pixels;
+    frame->num_leds = cfg.num_leds;
+    frame->reverse = cfg.counterclock;
+    frame->mirror = mirror;
+    frame->ring = mirror ? ring_head : 0;
+    if(mirror)
+        frame->offset = startled;
+    else if(cfg.counterclock)
+        frame->offset = in_range((int)startled - (int)ring_head);
+    else
+        frame->offset = in_range(startled + ring_head);
+    frame->lut = out_lut[wire_buf].table;
+    frame->frac = 0;
+    if((effect(cfg.algorithm)->flags & EFFECT_SUBPIXEL) && !mirror)
+        frame->frac = anim_frac >> 8;
+    // rotated and ring pixels come around again, the last one moves into the first LED
+    frame->wrap = (effect(cfg.algorithm)->flags & (EFFECT_ROTATE | EFFECT_RING)) != 0;
+    // the ring of walk moves the other way, blend towards the next offset instead
+    if(frame->frac && cfg.counterclock && (effect(cfg.algorithm)->flags & EFFECT_RING))
+    {
+        frame->offset = in_range((int)frame->offset - 1);
+        frame->frac = 256 - frame->frac;
+    }
+    frame->next = NULL;
+    return frame;
+}
+
+// fade in after power on, fade out after power off
+uint16_t Ledstrip::fade_scale()
+{
+    uint16_t scale = 256;
+    if(fade_in < cfg.fadein_ms)
+        scale = 256 * fade_in / cfg.fadein_ms;
+    if(!cfg.power)
+        scale = 256 - scale;
+    return scale;
+}
+
+/* Renders the canvas in physical order, then every member sends its slice of it.
+ * The members send all or none of their frames, so their ping-pong buffers stay in step with phys. */
+void Ledstrip::transmit_canvas()
+{
+    led_strip_frame_t* frame = prepare_frame(256);
+    color_t* out = phys[phys_buf];
+    to_physical(frame, out);
+
+    // the members are dark while the canvas is, whatever moves in phys
+    bool dark = fade_scale() == 0;
+    if(sent_valid && !force_send && fade_in >= cfg.fadein_ms &&
+       ((dark && sent_dark) || (dark == sent_dark && memcmp(out, phys[phys_buf ^ 1], led_strip_size()) == 0)))
+    {
+        frames_skipped++;
+        return;
+    }
+
+    for(int i=0; i<nr_members; i++)
+    {
+        member[i]->deadline = deadline;
+        member[i]->transmit();
+    }
+    tap_preview(frame);
+    sent_dark = dark;
+    frames_sent++;
+    last_sent = xTaskGetTickCount();
+    sent_valid = true;
+    phys_buf ^= 1;
 }
 
 void Ledstrip::transmit()
@@ -502,102 +1802,229 @@ void Ledstrip::transmit()
     if(cfg.num_leds == 0)
         return;
 
-    if(!cfg.power)
+    if(gpio_nr == GPIO_NUM_NC)
     {
-        memset(rmt_pixels, 0, led_strip_size());
+        if(nr_members > 0)
+            transmit_canvas();
+        return;
     }
-    else 
+
+    // a member strip fades with the canvas
+    uint16_t scale;
+    if(canvas)
+        scale = cfg.power ? canvas->fade_scale() : 0;
+    else
+        scale = fade_scale();
+
+    led_strip_frame_t* frame;
+    if(nr_seg > 0)
     {
-        uint32_t frac;
-        if(cfg.fadein_ms == 0 || fade_in == 0)
+        // the frames of all segments go out in one transmission
+        frame = NULL;
+        led_strip_frame_t* tail = NULL;
+        uint32_t num_send = sent_valid ? 0 : cfg.num_leds;
+        for(int i=0; i<nr_seg; i++)
         {
-            frac = 1;
-            fade_in = 1;
+            Ledstrip* s = seg[i];
+            led_strip_frame_t* f = s->prepare_frame(s->cfg.power ? scale : 0);
+            uint32_t p = s->changed_prefix(f);
+            if(p > 0 && s->seg_start + p > num_send)
+                num_send = s->seg_start + p;
+            if(tail)
+                tail->next = f;
+            else
+                frame = f;
+            tail = f;
         }
-        else if(fade_in < cfg.fadein_ms) 
-            frac = cfg.fadein_ms;
-        else
-            frac = fade_in;
-
-        for(int i=0; i<cfg.num_leds; i++)
+        frame->num_send = num_send;
+    }
+    else
+    {
+        frame = prepare_frame(scale);
+        if(xfade)
         {
-            int j = cfg.counterclock ? cfg.num_leds - 1 - i : i;
-            int n = in_range(i + startled) * 3;
-            rmt_pixels[n + 0] = led_strip_pixels[j].green * fade_in / frac;
-            rmt_pixels[n + 1] = led_strip_pixels[j].red * fade_in / frac;
-            rmt_pixels[n + 2] = led_strip_pixels[j].blue * fade_in / frac;
+            int64_t elapsed = esp_timer_get_time() - xfade_start;
+            if(elapsed < XFADE_US)
+            {
+                // blend in physical order, the old and new effect may map the LEDs differently
+                color_t* out = xfade_out[wire_buf];
+                to_physical(frame, out);
+                lerp8((uint8_t*)out, (const uint8_t*)xfade_from, (const uint8_t*)out, led_strip_size(), elapsed * 256 / XFADE_US);
+                frame->pixels = (const uint8_t*)out;
+                frame->offset = 0;
+                frame->reverse = false;
+                frame->mirror = 0;
+                frame->ring = 0;
+                frame->frac = 0;
+                frame->wrap = false;
+            }
+            else
+            {
+                xfade = false;
+            }
         }
+
+        // the canvas decides if its members send
+        frame->num_send = canvas ? cfg.num_leds : changed_prefix(frame);
+    }
+
+    if(frame->num_send == 0)
+    {
+        frames_skipped++;
+        return;
     }
 
+    esp_err_t ret = ESP_OK;
     if(rmt)
     {
-        rmt->transmit(gpio_nr, rmt_pixels, led_strip_size(), PERIOD_SECOND);
+        // returns as soon as the frame is queued, wire_free is given by the RMT done callback
+        wire_deadline[wire_buf] = deadline;
+        wire_done[wire_buf] = 0;
+        ret = rmt->transmit(gpio_nr, frame, wire_free[wire_buf], &wire_done[wire_buf], PERIOD_SECOND);
+        if(ret != ESP_OK)
+        {
+            wire_deadline[wire_buf] = 0;
+            missed_deadlines++;
+        }
     }
+    else
+    {
+        xSemaphoreGive(wire_free[wire_buf]);
+    }
+    tap_preview(frame);
+    frames_sent++;
+    last_sent = xTaskGetTickCount();
+    sent_valid = (ret == ESP_OK);
+
+    // continue rendering in the other frame, as soon as the RMT is done with it
+    int next = wire_buf ^ 1;
+    while(!xSemaphoreTake(wire_free[next], pdMS_TO_TICKS(PERIOD_SECOND)))
+        ESP_LOGW(TAG, "GPIO %d: frame still on the wire", gpio_nr);
+    // the time the frame before was on the wire, as the RMT saw it
+    if(wire_deadline[next] && wire_done[next] > wire_deadline[next])
+        missed_deadlines++;
+    wire_deadline[next] = 0;
+
+    wire_buf = next;
+    led_strip_pixels = pixel_buf[wire_buf];
+    /* The last frame is only copied over when it is needed: by the effects that draw on top of it,
+     * for a frame sent again while fading, and for segments that are not due. The canvas renders
+     * every frame of its members. */
+    behind = !canvas;
+    if(nr_seg > 0)
+        catch_up();
+    for(int i=0; i<nr_seg; i++)
+        seg[i]->sync_slice();
+
+    // the RMT is done with the older frame, the one just queued is not blended
+    if(!xfade && xfade_from && frame->pixels == (const uint8_t*)pixel_buf[next ^ 1])
+        xfade_free();
 }
 
-void Ledstrip::loop()
+uint32_t Ledstrip::frame_period()
 {
-    startTime = xTaskGetTickCount();
-    mainTask = xTaskGetCurrentTaskHandle();
-    ESP_LOGI(TAG, "started LED strip task at GPIO %d", gpio_nr);
-    while(mainTask)
-    {
-        TickType_t period;
-        TickType_t lastWakeTime = xTaskGetTickCount();
-        fade_in = pdTICKS_TO_MS(lastWakeTime - startTime);
-        switchLeds();  
-        
-        switch(cfg.algorithm)
+    if(cfg.num_leds == 0)
+        return PERIOD_SECOND;
+    return effect(cfg.algorithm)->period(cfg);
+}
+
+/* Called by the scheduler when the strip is due. Renders the effects that are due,
+ * otherwise (fading) sends the last frame again with the next fade step.
+ * Returns the time the strip is due again. */
+int64_t Ledstrip::render(int64_t due, bool woken)
+{
+    int64_t now = esp_timer_get_time();
+    if(!woken)
+    {
+        int64_t late = now - due;
+        if(late > jitter_max)
+            jitter_max = late;
+        jitter_sum += late;
+        jitter_cnt++;
+    }
+
+    TickType_t ticks = xTaskGetTickCount();
+    fade_in = pdTICKS_TO_MS(ticks - startTime);
+
+    xSemaphoreTake(seg_mutex, portMAX_DELAY);
+    int64_t next;
+    if(nr_seg > 0)
+    {
+        // every segment renders on its own period
+        next = INT64_MAX;
+        for(int i=0; i<nr_seg; i++)
         {
-            case ALGO_RAINBOW:
-            case ALGO_WALK:
-            case ALGO_GRADIENT:
-            case ALGO_BELT:
-            case ALGO_FIRE:
-                period = (SPEED_MAX_VAL - cfg.speed) * (SPEED_MAX_VAL - cfg.speed);
-                break;
-
-            case ALGO_CLOCK2:
-                period = PERIOD_SECOND * 60 / cfg.num_leds;
-                break;
-
-            default: 
-                period = PERIOD_SECOND; 
-                break;
+            Ledstrip* s = seg[i];
+            s->sync_slice();
+            int64_t t = s->step(now, due, woken || s->seg_woken);
+            s->seg_woken = false;
+            if(t < next)
+                next = t;
         }
+    }
+    else
+    {
+        next = step(now, due, woken);
+    }
 
-        TickType_t diff = xTaskGetTickCount() - lastWakeTime;
-        while(pdMS_TO_TICKS(period) > diff)
-        {
-            if(fade_in < cfg.fadein_ms)
-                transmit();
-            else if(pdMS_TO_TICKS(period) > diff)
-                vTaskDelay(pdMS_TO_TICKS(period) - diff);
+    if(fade_in < cfg.fadein_ms || xfade)
+    {
+        int64_t fade_step = RenderScheduler::next_slot(now, FADE_PERIOD * 1000);
+        if(fade_step < next)
+            next = fade_step;
+    }
 
-            fade_in = pdTICKS_TO_MS(lastWakeTime - startTime);
-            diff = xTaskGetTickCount() - lastWakeTime;
-        }
+    // the frame must be on the wire before the next one is due
+    deadline = next;
+    force_send = woken;
+    transmit();
+    xSemaphoreGive(seg_mutex);
+    return next;
+}
+
+// renders the effect if it is due, returns the time it is due again
+int64_t Ledstrip::step(int64_t now, int64_t due, bool woken)
+{
+    int64_t period = frame_period() * 1000LL;
+    if(period < 1000)
+        period = 1000;
+
+    if(woken || due >= render_due)
+    {
+        switchLeds();
+        render_due = RenderScheduler::next_slot(now, period);
+    }
+    return render_due;
+}
+
+// render in the next frame, a segment with its strip, a member of a canvas with the canvas
+void Ledstrip::wake()
+{
+    if(parent)
+    {
+        seg_woken = true;
+        parent->wake();
+    }
+    else if(canvas)
+    {
+        canvas->wake();
+    }
+    else if(sched)
+    {
+        sched->wake(this);
     }
 }
 
 void Ledstrip::switchNow()
 {
     cfg.power = true;
-    rmt->lock(PERIOD_SECOND);
-    xTaskAbortDelay( mainTask );
-    rmt->unlock();
+    wake();
 }
 
 void Ledstrip::onoff()
 {
     cfg.power = !cfg.power;
-    // wait until current LED switching is finished
-    rmt->lock(PERIOD_SECOND);
-    xTaskAbortDelay( mainTask );
-    rmt->unlock();
     startTime = xTaskGetTickCount();
-
-    // if we just waited until rmt->transmit finished, switch off now
-    if(!cfg.power)
-        switchLeds();
+    // the render task switches the LEDs, also off
+    wake();
 }
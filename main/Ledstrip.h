@@ -2,6 +2,11 @@
 
 #include <string>
 #include "RmtTxDriver.h"
+#include "RenderScheduler.h"
+#include "LedLayout.h"
+#include "PixelPreview.h"
+#include "ConfigSaver.h"
+#include "ConfigJournal.h"
 
 using namespace std;
 
@@ -15,15 +20,14 @@ typedef enum {
     ALGO_CLOCK2,
     ALGO_BELT,
     ALGO_FIRE,
+    ALGO_PLASMA,
+    ALGO_TEXT,
 } ledstrip_algo_t;
 
-class Ledstrip;
+#define LED_MAX_SEGMENTS    8
+#define LED_MAX_CANVAS      8       // strips in the canvas
 
-typedef struct {
-    ledstrip_algo_t algo;
-    string uri;
-    void (*func)(Ledstrip*);
-} ledfunc_table_t;
+class Ledstrip;
 
 typedef struct {
     uint8_t green;
@@ -32,6 +36,14 @@ typedef struct {
 } color_t;
 
 
+// everything a rotation-only effect renders its base pattern from
+typedef struct {
+    ledstrip_algo_t algo;
+    uint32_t num_leds;
+    uint32_t gradients;
+    color_t color1;
+} render_key_t;
+
 typedef struct 
 {
     uint32_t num_leds;
@@ -46,41 +58,241 @@ typedef struct
     bool power;
     char name[16];
     uint32_t fadein_ms;
+    uint32_t gamma;         // gamma * 10, 10 = linear
+    color_t  white;         // white point
 } led_config_t;
 
+// config file of the first release, the fields in front of gamma, followed by the pixels
+typedef struct
+{
+    uint32_t num_leds;
+    uint32_t led1;
+    bool counterclock;
+    ledstrip_algo_t algorithm;
+    color_t  color1;
+    color_t  color2;
+    uint32_t bright;
+    uint32_t speed;
+    uint32_t gradients;
+    bool power;
+    char name[16];
+    uint32_t fadein_ms;
+} led_config_v0_t;
+static_assert(sizeof(led_config_v0_t) == 60, "layout of the released config files");
+
+void config_from_v0(led_config_t& cfg, const led_config_v0_t& v0);
+
+// effect flags
+#define EFFECT_TIMED    0x01    // shows the time of day
+#define EFFECT_STATIC   0x02    // the frame only changes with the config
+#define EFFECT_ROTATE   0x04    // a cached base pattern is only rotated
+#define EFFECT_RING     0x08    // pixels are shifted through the ring
+#define EFFECT_COLOR2   0x10    // the color wheel sets color1 and color2 alternately
+#define EFFECT_SUBPIXEL 0x20    // positions between two LEDs are blended into both
+#define EFFECT_2D       0x40    // renders into the grid of the layout
+#define EFFECT_STOPS    0x80    // the gradient stops in the pixels are saved with the config
+#define EFFECT_PAINTED  0x100   // the painted LEDs are saved with the config
+#define EFFECT_KEEPS    (EFFECT_STATIC | EFFECT_ROTATE | EFFECT_RING | EFFECT_PAINTED)  // draw on top of the last frame
+
+// one entry per effect
+typedef struct {
+    ledstrip_algo_t algo;
+    const char* uri;
+    void (*func)(Ledstrip*);
+    uint32_t (*period)(const led_config_t& cfg);    // frame period in ms
+    uint32_t flags;
+    void (*paint)(Ledstrip*, color_t);  // color wheel paints into the pixels, nullptr: sets color1
+} ledfunc_table_t;
+
+// parameters of the output stage
+typedef struct {
+    uint32_t bright;
+    uint32_t gamma;
+    color_t  white;
+    uint16_t scale;         // fade step, 0 ... 256
+} output_param_t;
+
+typedef struct {
+    uint8_t table[3][256];  // green, red, blue like color_t
+    output_param_t param;   // table was built for these parameters
+} output_lut_t;
+
 class Ledstrip {
-    color_t* led_strip_pixels;
-    uint8_t* rmt_pixels;
-    char cfgfile_path[32];
+    color_t* led_strip_pixels;      // frame that is rendered now, one of pixel_buf
+    color_t* pixel_buf[2];          // ping-pong frames, the encoder reads them in place
+    led_strip_frame_t wire_frame[2];
+    output_lut_t* out_lut;          // [2], one per frame, a queued frame keeps its table
+    uint8_t gamma_curve[256];       // gamma of every byte, the tables only scale it
+    uint32_t gamma_curve_of;        // cfg.gamma the curve was built for, 0: none
+    SemaphoreHandle_t wire_free[2]; // given when the RMT is done with the frame
+    int64_t wire_deadline[2];       // us, the frame must be on the wire by then, 0: not checked
+    volatile int64_t wire_done[2];  // us, set by the RMT when the frame is on the wire
+    int wire_buf;                   // index of led_strip_pixels in pixel_buf
+    char cfgfile_path[32];          // name of the config, .jnl holds the journal, .bin is the old format
+    ConfigJournal journal;
+    led_config_t saved_cfg;         // config in the journal
+    string saved_state;             // last pixel state in the journal, record type first
     uint32_t startled;
-    TaskHandle_t mainTask;
-    int lastSec;
+    uint32_t ring_head;             // shifting effects move this instead of the pixels
+    uint32_t mirror;                // belt: center LED, pixels mirrored around it
+    render_key_t base_key;          // base pattern in the pixels was rendered for this
+    bool base_valid;
+    uint8_t* heat;                  // fire: heat of every LED
+    ledstrip_algo_t shown_algo;     // effect of the frames sent
+    bool xfade;                     // cross-fading from xfade_from to the current effect
+    int64_t xfade_start;            // us
+    color_t* xfade_from;            // last frame of the old effect, in physical order
+    color_t* xfade_out[2];          // blended frames, one per wire_frame, in the block of xfade_from
+    int64_t anim_time;              // us, time of the last animation step
+    uint32_t anim_frac;             // fraction of the next LED step, 16 bit
+    uint32_t anim_steps;            // whole LED steps of the current frame
+    uint32_t anim_pos;              // LED steps of 2D effects since they started
+    uint32_t rng_state;             // xorshift32, every strip has its own
+    uint32_t time_gen;              // SNTP sync the clock effects have shown
+    uint8_t* face;                  // clock2: 1 for the LEDs of the hour markers
+    uint32_t face_leds;             // number of LEDs face was built for
     RmtTxDriver* rmt;
+    RenderScheduler* sched;
+    ConfigSaver* saver;             // writes the config in the background, NULL: at once
+    int64_t render_due;             // us, the effect renders its next frame at this time
     gpio_num_t gpio_nr;
     uint32_t fade_in;
     TickType_t startTime;
+    int64_t deadline;               // us, the current frame must be on the wire by then
+    uint32_t missed_deadlines;
+    bool sent_valid;                // pixel_buf[wire_buf ^ 1] holds the last frame sent
+    bool behind;                    // pixel_buf[wire_buf] does not hold the last frame yet, see catch_up()
+    bool sent_dark;                 // canvas: the last frame sent was all dark
+    TickType_t last_sent;
+    uint32_t frames_sent;
+    uint32_t frames_skipped;
+    int64_t jitter_max;             // us, latest start of a frame after its deadline
+    int64_t jitter_sum;
+    uint32_t jitter_cnt;
+    PixelPreview* preview;          // gets a copy of the frames sent now and then, or NULL
+
+    // segments: Ledstrips that render into a slice of this strip
+    Ledstrip* parent;               // strip of this segment, NULL for a strip
+    uint32_t seg_start;             // first LED of the segment in the strip
+    uint32_t seg_len;
+    bool seg_woken;                 // render this segment in the next frame
+    Ledstrip* seg[LED_MAX_SEGMENTS];
+    int nr_seg;
+    SemaphoreHandle_t seg_mutex;    // held while rendering and while changing the segments or the canvas
+
+    // canvas: a Ledstrip without GPIO, renders one effect over several strips
+    Ledstrip* canvas;               // canvas this strip shows a slice of, or NULL
+    Ledstrip* member[LED_MAX_CANVAS];
+    int nr_members;
+    color_t* phys[2];               // canvas in physical order, one per frame of the members
+    int phys_buf;                   // phys rendered now
+    color_t* own_buf[2];            // pixel_buf of a member, while it shows the canvas
+    bool force_send;                // send even if the canvas did not change
+
+    // 2D effects render into the grid, prepare_frame() gathers it into the pixels
+    LedLayout layout;
+    color_t* grid;                  // layout.cells() + 1, the last cell stays dark
+
+    // ticker: the text is rasterized into columns once, every frame shows a window of them
+    char text[64];                  // empty: the time of day
+    string saved_text;              // text in text.txt, written by writeConfig()
+    string text_shown;              // text in text_cols
+    uint8_t* text_cols;             // one byte per column, bit 0 is the top row
+    uint32_t text_len;              // columns, with a gap of one grid width behind the text
+    uint32_t text_width;            // grid width text_cols was built for
 
     void new_led_strip_pixels(uint32_t nr_leds);
     size_t led_strip_size() { return cfg.num_leds * 3; }
+    uint32_t frame_period();
     void switchLeds();
     static uint8_t get_gradient(uint8_t color1, uint8_t color2, int a, int b, int i);
     int in_range(int lednr);
+    void ring_reset();
+    bool base_cached();
     void transmit();
+    void transmit_canvas();
+    uint16_t fade_scale();
+    void join_canvas(Ledstrip* c, uint32_t start);
+    void leave_canvas();
+    led_strip_frame_t* prepare_frame(uint16_t scale);
+    int64_t step(int64_t now, int64_t due, bool woken);
+    void wake();
+    void sync_slice();
+    void restoreSegments();
+    void update_lut(output_lut_t* lut, uint16_t scale);
+    uint32_t changed_prefix(const led_strip_frame_t* frame);
+    void wait_wire_done();
     uint8_t colorchange1(uint8_t ledcol);
+    uint8_t random8();
+    uint8_t random8(uint8_t lim);
+    uint32_t advance();
+    void fire_step();
+    void to_physical(const led_strip_frame_t* frame, color_t* out, uint32_t max_leds = UINT32_MAX);
+    void tap_preview(const led_strip_frame_t* frame);
+    void xfade_begin();
+    void xfade_free();
+    void new_grid();
+    void gather();
+    void catch_up();
+    void side_path(char* path, size_t len, const char* suffix);
+    SemaphoreHandle_t render_mutex() { return parent ? parent->seg_mutex : seg_mutex; }
+    void restoreLayout();
+    void restoreText();
+    void writeText(const string& s);
+    bool restoreLegacy();
+    uint8_t pixel_state(string& data);
+    void apply_state(const string& state);
+    void write_journal(const led_config_t& c, const string& state, bool compact);
+    void rasterize(const string& s, uint32_t width);
+    void build_face();
+    esp_err_t apply_layout(esp_err_t ret);
+
+    // per-pixel kernel, inlined into the loop over all LEDs
+    template<typename Kernel> void fill(Kernel kernel)
+    {
+        color_t* px = led_strip_pixels;
+        for(uint32_t j=0; j<cfg.num_leds; j++)
+            px[j] = kernel(j);
+    }
+
+    // per-cell kernel of a 2D effect, kernel(x, y)
+    template<typename Kernel> void fill2d(Kernel kernel)
+    {
+        color_t* px = grid;
+        uint32_t w = layout.grid_width();
+        uint32_t h = layout.grid_height();
+        for(uint32_t y=0; y<h; y++)
+            for(uint32_t x=0; x<w; x++)
+                *px++ = kernel(x, y);
+    }
 
 public:
     led_config_t cfg;
     static const ledfunc_table_t ledfunc_table[];
+    static const ledfunc_table_t* effect(ledstrip_algo_t algo);
 
     Ledstrip();
     ~Ledstrip();
-    void loop();
+    int64_t render(int64_t due, bool woken);
 
-    esp_err_t init(const char* spiffs_path, RmtTxDriver* rmt_inst, gpio_num_t gpionr);
+    esp_err_t init(const char* spiffs_path, RmtTxDriver* rmt_inst, RenderScheduler* sched_inst, ConfigSaver* saver_inst, gpio_num_t gpionr);
     void saveConfig();
+    void writeConfig();
     void restoreConfig();
     void switchNow();
+    void set_preview(PixelPreview* p) { preview = p; }
     void onoff();
+    void seed(uint32_t s);
+    esp_err_t set_segments(const uint32_t* len, int n);
+    Ledstrip* segment(int i) { return (i >= 0 && i < nr_seg) ? seg[i] : NULL; }
+    bool is_segment() { return parent != NULL; }
+    esp_err_t set_canvas(Ledstrip* const* strips, int n);
+    int canvas_size() { return nr_members; }
+    esp_err_t set_matrix(uint16_t width, uint16_t height, uint32_t flags);
+    esp_err_t set_points(const char* path);
+    const layout_config_t& layout_cfg() { return layout.cfg; }
+    void set_text(const char* s);
+    void paint(color_t color, bool restart);
 
     // LED algorithms
     void monocolor();
@@ -94,6 +306,8 @@ public:
     void add_gradient(color_t color);
     void belt();
     void fire();
+    void plasma();
+    void ticker();
 
     string to_json(led_config_t& cfg);
     static string to_json(const string& tag, uint32_t nr);
@@ -0,0 +1,170 @@
+#include "PixelPreview.h"
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "preview";
+
+#define OUT_SIZE    (PREVIEW_HDR + PREVIEW_RUN_HDR + 3 * PREVIEW_MAX_LEDS)
+
+static inline void put16(uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+PixelPreview::PixelPreview()
+{
+    lock = xSemaphoreCreateMutex();
+    shot = NULL;
+    sent = NULL;
+    out = NULL;
+    shot_leds = 0;
+    sent_leds = 0;
+    fresh = false;
+    wanted = false;
+    budget = 0;
+    budget_tick = 0;
+    budget_max = 0;
+}
+
+PixelPreview::~PixelPreview()
+{
+    stop();
+    vSemaphoreDelete(lock);
+}
+
+// rate: calls of encode() per second, the buffers only exist while the preview runs
+esp_err_t PixelPreview::start(uint32_t rate, uint32_t bytes_per_sec)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if(shot == NULL)
+    {
+        shot = new uint8_t[3 * PREVIEW_MAX_LEDS];
+        sent = new uint8_t[3 * PREVIEW_MAX_LEDS];
+        out = new uint8_t[OUT_SIZE];
+        ESP_LOGI(TAG, "started, %d frames/s, %d bytes/s", (int)rate, (int)bytes_per_sec);
+    }
+    budget_tick = bytes_per_sec / (rate ? rate : 1);
+    // a key frame must fit in, however slow
+    budget_max = bytes_per_sec > OUT_SIZE ? bytes_per_sec : OUT_SIZE;
+    budget = budget_max;
+    sent_leds = 0;
+    fresh = false;
+    wanted = true;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+void PixelPreview::stop()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    wanted = false;
+    delete[] shot;
+    delete[] sent;
+    delete[] out;
+    shot = sent = out = NULL;
+    xSemaphoreGive(lock);
+}
+
+// NULL if no frame is wanted now, or the last one is being encoded
+uint8_t* PixelPreview::begin_capture()
+{
+    if(!wanted || xSemaphoreTake(lock, 0) != pdTRUE)
+        return NULL;
+    if(shot == NULL)
+    {
+        xSemaphoreGive(lock);
+        return NULL;
+    }
+    return shot;
+}
+
+void PixelPreview::end_capture(uint32_t num_leds)
+{
+    shot_leds = num_leds;
+    fresh = true;
+    wanted = false;
+    xSemaphoreGive(lock);
+}
+
+size_t PixelPreview::put_run(size_t pos, uint32_t first, uint32_t n)
+{
+    put16(&out[pos], first);
+    put16(&out[pos + 2], n);
+    pos += PREVIEW_RUN_HDR;
+    const uint8_t* px = &shot[3 * first];
+    for(uint32_t i=0; i<n; i++, px+=3)
+    {
+        out[pos++] = px[1];
+        out[pos++] = px[0];
+        out[pos++] = px[2];
+    }
+    return pos;
+}
+
+// the runs that changed, a key frame if that is not longer; 0 if nothing changed
+size_t PixelPreview::encode_frame()
+{
+    uint32_t n = shot_leds;
+    size_t key_len = PREVIEW_HDR + PREVIEW_RUN_HDR + 3 * n;
+    bool key = sent_leds != n;
+    size_t pos = PREVIEW_HDR;
+    uint32_t i = 0;
+    while(!key && i < n)
+    {
+        if(same(i))
+        {
+            i++;
+            continue;
+        }
+        uint32_t end = i + 1;
+        for(uint32_t j=end; j<n && j<=end + PREVIEW_RUN_GAP; j++)
+        {
+            if(!same(j))
+                end = j + 1;
+        }
+        if(pos + PREVIEW_RUN_HDR + 3 * (end - i) > key_len)
+            key = true;
+        else
+            pos = put_run(pos, i, end - i);
+        i = end;
+    }
+    if(key)
+        pos = put_run(PREVIEW_HDR, 0, n);
+    else if(pos == PREVIEW_HDR)
+        return 0;
+
+    out[0] = 'P';
+    out[1] = key;
+    put16(&out[2], n);
+    return pos;
+}
+
+/* The frame captured since the last call, for data(). 0 if there is none, or it would exceed
+ * the data rate; the clients keep the older frame then and the next one carries the changes. */
+size_t PixelPreview::encode()
+{
+    size_t len = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    budget += budget_tick;
+    if(budget > budget_max)
+        budget = budget_max;
+    if(fresh && out)
+    {
+        len = encode_frame();
+        if((int32_t)len > budget)
+        {
+            len = 0;
+        }
+        else if(len > 0)
+        {
+            budget -= len;
+            memcpy(sent, shot, 3 * shot_leds);
+            sent_leds = shot_leds;
+        }
+        fresh = false;
+    }
+    wanted = (out != NULL);
+    xSemaphoreGive(lock);
+    return len;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+
+#define PREVIEW_MAX_LEDS    2048    // LEDs behind are not previewed
+#define PREVIEW_RUN_GAP     1       // unchanged LEDs between two changes are sent along, cheaper than a new run
+#define PREVIEW_HDR         4       // 'P', 1 for a key frame, number of LEDs (uint16_t)
+#define PREVIEW_RUN_HDR     4       // first LED, number of LEDs (uint16_t each), then RGB per LED
+
+/* Frames sent to a strip, for a live preview in the web UI.
+ * The render task copies a frame once it is asked for one, it never waits for the lock.
+ * encode() packs the runs of LEDs that changed since the last frame encoded, all integers little endian. */
+class PixelPreview {
+    SemaphoreHandle_t lock;
+    uint8_t* shot;              // GRB per LED, in physical order, the last frame captured
+    uint8_t* sent;              // the frame the clients show
+    uint8_t* out;               // encoded frame
+    uint32_t shot_leds;
+    uint32_t sent_leds;         // 0: the next frame is a key frame
+    bool fresh;                 // shot was not encoded yet
+    volatile bool wanted;       // capture the next frame sent
+    int32_t budget;             // bytes that may be sent now
+    int32_t budget_tick;        // added by every encode()
+    int32_t budget_max;
+
+    bool same(uint32_t i) { return memcmp(&shot[3 * i], &sent[3 * i], 3) == 0; }
+    size_t put_run(size_t pos, uint32_t first, uint32_t n);
+    size_t encode_frame();
+
+public:
+    PixelPreview();
+    ~PixelPreview();
+
+    esp_err_t start(uint32_t rate, uint32_t bytes_per_sec);
+    void stop();
+    void restart() { sent_leds = 0; }
+
+    // render task
+    uint8_t* begin_capture();
+    void end_capture(uint32_t num_leds);
+
+    size_t encode();
+    const uint8_t* data() { return out; }
+};
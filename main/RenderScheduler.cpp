@@ -0,0 +1,207 @@
+#include "RenderScheduler.h"
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "Ledstrip.h"
+
+static const char *TAG = "RenderScheduler";
+
+#define STACK_SIZE      CONFIG_ESP_MAIN_TASK_STACK_SIZE
+
+RenderScheduler::RenderScheduler()
+{
+    memset(heap, 0, sizeof(heap));
+    nr_slots = 0;
+    task = NULL;
+    timer = NULL;
+    portMUX_INITIALIZE(&lock);
+    poll = NULL;
+    poll_arg = NULL;
+}
+
+RenderScheduler::~RenderScheduler()
+{
+    if(timer)
+    {
+        esp_timer_stop(timer);
+        esp_timer_delete(timer);
+    }
+    if(task)
+        vTaskDelete(task);
+}
+
+void RenderScheduler::c_task(void* arg)
+{
+    RenderScheduler* sched = (RenderScheduler*)arg;
+    sched->loop();
+}
+
+void RenderScheduler::on_timer(void* arg)
+{
+    RenderScheduler* sched = (RenderScheduler*)arg;
+    xTaskNotifyGive(sched->task);
+}
+
+int RenderScheduler::find(Ledstrip* strip)
+{
+    for(int i=0; i<nr_slots; i++)
+    {
+        if(heap[i].strip == strip)
+            return i;
+    }
+    return -1;
+}
+
+void RenderScheduler::sift_up(int i)
+{
+    while(i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if(heap[parent].deadline <= heap[i].deadline)
+            break;
+        render_slot_t tmp = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = tmp;
+        i = parent;
+    }
+}
+
+void RenderScheduler::sift_down(int i)
+{
+    while(true)
+    {
+        int first = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if(l < nr_slots && heap[l].deadline < heap[first].deadline)
+            first = l;
+        if(r < nr_slots && heap[r].deadline < heap[first].deadline)
+            first = r;
+        if(first == i)
+            break;
+        render_slot_t tmp = heap[first];
+        heap[first] = heap[i];
+        heap[i] = tmp;
+        i = first;
+    }
+}
+
+// call with lock held
+void RenderScheduler::reschedule(int i, int64_t deadline)
+{
+    int64_t old = heap[i].deadline;
+    heap[i].deadline = deadline;
+    if(deadline < old)
+        sift_up(i);
+    else
+        sift_down(i);
+}
+
+esp_err_t RenderScheduler::add(Ledstrip* strip)
+{
+    if(nr_slots >= RENDER_MAX_STRIPS)
+    {
+        ESP_LOGE(TAG, "no more than %d LED strips", RENDER_MAX_STRIPS);
+        return ESP_ERR_NO_MEM;
+    }
+    portENTER_CRITICAL(&lock);
+    heap[nr_slots].strip = strip;
+    heap[nr_slots].deadline = esp_timer_get_time();
+    heap[nr_slots].woken = false;
+    nr_slots++;
+    sift_up(nr_slots - 1);
+    portEXIT_CRITICAL(&lock);
+
+    if(task)
+        xTaskNotifyGive(task);
+    return ESP_OK;
+}
+
+void RenderScheduler::remove(Ledstrip* strip)
+{
+    portENTER_CRITICAL(&lock);
+    int i = find(strip);
+    if(i >= 0)
+    {
+        nr_slots--;
+        heap[i] = heap[nr_slots];
+        if(i < nr_slots)
+        {
+            sift_up(i);
+            sift_down(i);
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+esp_err_t RenderScheduler::start()
+{
+    esp_timer_create_args_t timer_args = {
+        .callback = on_timer,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "render",
+        .skip_unhandled_events = true,
+    };
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &timer), TAG, "create timer failed");
+
+    if(xTaskCreate(c_task, "RenderTask", STACK_SIZE, this, 1, &task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "could not create the render task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "rendering %d LED strips", nr_slots);
+    return ESP_OK;
+}
+
+// render the strip as soon as possible, e.g. after a config change
+void RenderScheduler::wake(Ledstrip* strip)
+{
+    portENTER_CRITICAL(&lock);
+    int i = find(strip);
+    if(i >= 0)
+    {
+        heap[i].woken = true;
+        reschedule(i, esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if(task)
+        xTaskNotifyGive(task);
+}
+
+void RenderScheduler::loop()
+{
+    while(true)
+    {
+        if(poll)
+            poll(poll_arg);
+
+        portENTER_CRITICAL(&lock);
+        int64_t now = esp_timer_get_time();
+        render_slot_t due = heap[0];
+        bool ready = nr_slots > 0 && due.deadline <= now;
+        if(ready)
+            heap[0].woken = false;
+        portEXIT_CRITICAL(&lock);
+
+        if(!ready)
+        {
+            // sleep until the first deadline or a wake()
+            esp_timer_stop(timer);
+            if(nr_slots > 0)
+                esp_timer_start_once(timer, due.deadline - now);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        int64_t next = due.strip->render(due.deadline, due.woken);
+
+        portENTER_CRITICAL(&lock);
+        int i = find(due.strip);
+        // a wake() while rendering keeps its deadline
+        if(i >= 0 && !heap[i].woken)
+            reschedule(i, next);
+        portEXIT_CRITICAL(&lock);
+    }
+}
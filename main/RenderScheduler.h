@@ -0,0 +1,51 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#define RENDER_MAX_STRIPS   (CONFIG_NR_LEDSTRIPS + 1)    // every strip and the canvas
+
+class Ledstrip;
+
+// a strip and the time its next frame is due
+typedef struct {
+    Ledstrip* strip;
+    int64_t deadline;       // us, esp_timer_get_time()
+    bool woken;             // render now, the config changed
+} render_slot_t;
+
+/* Renders all LED strips in one task, always the strip with the earliest deadline.
+ * Deadlines are kept in a min-heap, the task sleeps on an esp_timer until the first one is due. */
+class RenderScheduler {
+    render_slot_t heap[RENDER_MAX_STRIPS];
+    int nr_slots;
+    TaskHandle_t task;
+    esp_timer_handle_t timer;
+    portMUX_TYPE lock;
+    void (*poll)(void* arg);    // called by the task every time it wakes up, e.g. for work a timer handed over
+    void* poll_arg;
+
+    static void c_task(void* arg);
+    static void on_timer(void* arg);
+    void loop();
+    int find(Ledstrip* strip);
+    void sift_up(int i);
+    void sift_down(int i);
+    void reschedule(int i, int64_t deadline);
+
+public:
+    RenderScheduler();
+    ~RenderScheduler();
+
+    esp_err_t add(Ledstrip* strip);
+    void remove(Ledstrip* strip);
+    esp_err_t start();
+    void wake(Ledstrip* strip);
+    void set_poll(void (*fn)(void* arg), void* arg) { poll = fn; poll_arg = arg; }
+
+    /* First multiple of period after now. Strips with the same period render in the same instants,
+     * a strip that fell behind skips the frames it missed. */
+    static int64_t next_slot(int64_t now, int64_t period) { return (now / period + 1) * period; }
+};
@@ -1,55 +1,255 @@
 #include "RmtTxDriver.h"
 #include <cstring>
-#include "led_strip_encoder.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 
 static const char *TAG = "RmtTxDriver";
 
 #define RMT_LED_STRIP_RESOLUTION_HZ 10000000 // 10MHz resolution, 1 tick = 0.1us (led strip needs a high resolution)
+#define RMT_SYNC_WINDOW_US  (CONFIG_LED_SYNC_WINDOW_MS * 1000)
+
+// 50us low, latches the previous frame without changing any LED
+static const rmt_symbol_word_t latch_code = {
+    .duration0 = RMT_LED_STRIP_RESOLUTION_HZ / 1000000 * 50 / 2,
+    .level0 = 0,
+    .duration1 = RMT_LED_STRIP_RESOLUTION_HZ / 1000000 * 50 / 2,
+    .level1 = 0,
+};
 
 RmtTxDriver::RmtTxDriver()
 {
-    led_chan = NULL;
-    led_encoder = NULL;
+    memset(chan, 0, sizeof(chan));
+    nr_chan = 0;
+    synchro = NULL;
+    sync_timer = NULL;
+    sync_expired = false;
+    flush_task = NULL;
     memset(&tx_chan_config, 0, sizeof(tx_chan_config));
     memset(&tx_config, 0, sizeof(tx_config));
     tx_chan_config.clk_src = RMT_CLK_SRC_DEFAULT; // select source clock
     tx_chan_config.mem_block_symbols = 64; // increase the block size can make the LED less flickering
     tx_chan_config.resolution_hz = RMT_LED_STRIP_RESOLUTION_HZ;
-    tx_chan_config.trans_queue_depth = 4; // set the number of transactions that can be pending in the background
+    tx_chan_config.trans_queue_depth = RMT_TX_QUEUE_DEPTH; // set the number of transactions that can be pending in the background
     tx_config.loop_count = 0; // no transfer loop
     mutex = xSemaphoreCreateMutex();
-
+    chan_idle = xSemaphoreCreateCounting(RMT_TX_PENDING_SIZE * RMT_TX_MAX_CHANNELS, 0);
 }
 
 RmtTxDriver::~RmtTxDriver()
 {
+    if(sync_timer)
+        esp_timer_delete(sync_timer);
+    if(synchro)
+        rmt_del_sync_manager(synchro);
     vSemaphoreDelete(mutex);
+    vSemaphoreDelete(chan_idle);
 }
 
-esp_err_t RmtTxDriver::init(gpio_num_t gpionr)
+esp_err_t RmtTxDriver::new_channel(gpio_num_t gpionr)
 {
+    rmt_tx_chan_t* ch = &chan[nr_chan];
     tx_chan_config.gpio_num = gpionr;
-    ESP_LOGI(TAG, "Create RMT TX channel");
-    ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_chan_config, &led_chan));
+    ESP_LOGI(TAG, "Create RMT TX channel for GPIO %d", gpionr);
+    ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_chan_config, &ch->handle));
+
+    rmt_tx_event_callbacks_t cbs = {
+        .on_trans_done = on_trans_done,
+    };
+    ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(ch->handle, &cbs, ch));
 
-    ESP_LOGI(TAG, "Install led strip encoder");
+    // encoders keep state while encoding, every channel needs its own
     led_strip_encoder_config_t encoder_config = {
         .resolution = RMT_LED_STRIP_RESOLUTION_HZ,
     };
-    ESP_ERROR_CHECK(rmt_new_led_strip_encoder(&encoder_config, &led_encoder));
-    return rmt_enable(led_chan);
+    ESP_ERROR_CHECK(rmt_new_led_strip_encoder(&encoder_config, &ch->led_encoder));
+    rmt_copy_encoder_config_t copy_encoder_config = {};
+    ESP_ERROR_CHECK(rmt_new_copy_encoder(&copy_encoder_config, &ch->latch_encoder));
+
+    ch->gpio = gpionr;
+    ch->drv = this;
+    nr_chan++;
+    return rmt_enable(ch->handle);
+}
+
+/* One TX channel per GPIO, up to the number of TX channels of the SoC.
+ * With sync and if all GPIOs got a channel, a sync manager starts them in the same instant.
+ * Otherwise the channels are a pool, handed out per frame. */
+esp_err_t RmtTxDriver::init(const gpio_num_t* gpios, int nr_gpios, bool sync)
+{
+    int n = nr_gpios < RMT_TX_MAX_CHANNELS ? nr_gpios : RMT_TX_MAX_CHANNELS;
+    tx_chan_config.mem_block_symbols = SOC_RMT_MEM_WORDS_PER_CHANNEL;
+    for(int i=0; i<n; i++)
+    {
+        esp_err_t ret = new_channel(gpios[i]);
+        if(ret != ESP_OK)
+            return ret;
+    }
+
+    if(nr_gpios > n)
+    {
+        ESP_LOGW(TAG, "%d LED strips share %d TX channels", nr_gpios, n);
+        return ESP_OK;
+    }
+    if(!sync || n < 2)
+        return ESP_OK;
+
+    rmt_channel_handle_t handles[RMT_TX_MAX_CHANNELS];
+    for(int i=0; i<n; i++)
+        handles[i] = chan[i].handle;
+
+    rmt_sync_manager_config_t synchro_config = {
+        .tx_channel_array = handles,
+        .array_size = (size_t)n,
+    };
+    ESP_ERROR_CHECK(rmt_new_sync_manager(&synchro_config, &synchro));
+
+    esp_timer_create_args_t timer_args = {
+        .callback = on_sync_timeout,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "rmt_sync",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sync_timer));
+    ESP_LOGI(TAG, "%d TX channels started synchronized", n);
+    return ESP_OK;
+}
+
+bool IRAM_ATTR RmtTxDriver::on_trans_done(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *user_ctx)
+{
+    rmt_tx_chan_t* ch = (rmt_tx_chan_t*)user_ctx;
+    BaseType_t high_task_woken = pdFALSE;
+    if(ch->pending_head != ch->pending_tail)
+    {
+        rmt_tx_pending_t* p = &ch->pending[ch->pending_head % RMT_TX_PENDING_SIZE];
+        if(p->done_at)
+            *p->done_at = esp_timer_get_time();
+        ch->pending_head = ch->pending_head + 1;
+        if(p->done)
+            xSemaphoreGiveFromISR(p->done, &high_task_woken);
+        if(ch->pending_head == ch->pending_tail)
+            xSemaphoreGiveFromISR(ch->drv->chan_idle, &high_task_woken);
+    }
+
+    return high_task_woken == pdTRUE;
+}
+
+// runs in the esp_timer task, which must not wait for the channels; the transmitting task flushes
+void RmtTxDriver::on_sync_timeout(void* arg)
+{
+    RmtTxDriver* drv = (RmtTxDriver*)arg;
+    drv->sync_expired = true;
+    if(drv->flush_task)
+        xTaskNotifyGive(drv->flush_task);
+}
+
+// starts the staged frames if their sync window timed out, called by the task that transmits
+void RmtTxDriver::poll()
+{
+    if(!sync_expired)
+        return;
+    sync_expired = false;
+    if(lock(CONFIG_LED_SYNC_WINDOW_MS) != ESP_OK)
+        return;
+
+    flush_staged();
+    unlock();
 }
 
-esp_err_t RmtTxDriver::transmit(uint8_t* pixels, size_t nr_pixels, int timeout_ms)
+/* Queue a frame for transmission and return without waiting for the wire.
+ * The caller must keep the frame and its pixels untouched until done is given.
+ * frame == NULL queues a latch code only. */
+esp_err_t RmtTxDriver::queue(rmt_tx_chan_t* ch, const led_strip_frame_t* frame, SemaphoreHandle_t done, volatile int64_t* done_at)
 {
-    esp_err_t ret = rmt_transmit(led_chan, led_encoder, pixels, nr_pixels, &tx_config);
-    if(ret == ESP_OK)
-        ret = rmt_tx_wait_all_done(led_chan, timeout_ms);
+    rmt_tx_pending_t* p = &ch->pending[ch->pending_tail % RMT_TX_PENDING_SIZE];
+    p->done = done;
+    p->done_at = done_at;
+    ch->pending_tail = ch->pending_tail + 1;
 
+    esp_err_t ret;
+    if(frame)
+        ret = rmt_transmit(ch->handle, ch->led_encoder, frame, sizeof(*frame), &tx_config);
+    else
+        ret = rmt_transmit(ch->handle, ch->latch_encoder, &latch_code, sizeof(latch_code), &tx_config);
+
+    if(ret != ESP_OK)
+    {
+        ch->pending_tail = ch->pending_tail - 1;
+        if(done)
+            xSemaphoreGive(done);
+    }
     return ret;
 }
 
+// start all channels of the sync manager, must be called locked
+void RmtTxDriver::flush_staged()
+{
+    bool any = false;
+    for(int i=0; i<nr_chan; i++)
+        any |= chan[i].staged;
+    if(!any)
+        return;
+
+    esp_timer_stop(sync_timer);
+    for(int i=0; i<nr_chan; i++)
+        rmt_tx_wait_all_done(chan[i].handle, -1);
+    rmt_sync_reset(synchro);
+
+    for(int i=0; i<nr_chan; i++)
+    {
+        rmt_tx_chan_t* ch = &chan[i];
+        if(ch->staged)
+            queue(ch, ch->staged_frame, ch->staged_done, ch->staged_done_at);
+        else
+            queue(ch, NULL, NULL, NULL);
+        ch->staged = false;
+    }
+}
+
+rmt_tx_chan_t* RmtTxDriver::find_channel(gpio_num_t gpionr)
+{
+    for(int i=0; i<nr_chan; i++)
+    {
+        if(chan[i].gpio == gpionr)
+            return &chan[i];
+    }
+    return NULL;
+}
+
+static bool is_idle(rmt_tx_chan_t* ch)
+{
+    return ch->pending_head == ch->pending_tail;
+}
+
+/* The channel a frame for gpionr may go to now, or NULL.
+ * A GPIO must never be driven by two channels, so a channel already on the same GPIO is the only choice. */
+rmt_tx_chan_t* RmtTxDriver::candidate(gpio_num_t gpionr)
+{
+    rmt_tx_chan_t* ch = find_channel(gpionr);
+    if(ch)
+        return ch;
+
+    for(int i=0; i<nr_chan; i++)
+    {
+        if(is_idle(&chan[i]))
+            return &chan[i];
+    }
+    return NULL;
+}
+
+void RmtTxDriver::switch_gpio(rmt_tx_chan_t* ch, gpio_num_t gpionr, int timeout_ms)
+{
+    if(gpionr == ch->gpio)
+        return;
+
+    // the frames of the previous strip must be on the wire before switching
+    rmt_tx_wait_all_done(ch->handle, timeout_ms);
+    ESP_ERROR_CHECK(rmt_disable(ch->handle));
+    rmt_tx_switch_gpio(ch->handle, gpionr, false);
+    ch->gpio = gpionr;
+    ESP_ERROR_CHECK(rmt_enable(ch->handle));
+}
+
 esp_err_t RmtTxDriver::lock(int timeout_ms)
 {
     if(!xSemaphoreTake(mutex, pdMS_TO_TICKS(timeout_ms)))
@@ -63,21 +263,90 @@ void RmtTxDriver::unlock()
     xSemaphoreGive(mutex);
 }
 
-esp_err_t RmtTxDriver::transmit(gpio_num_t gpionr, uint8_t *pixels, size_t nr_pixels, int timeout_ms)
+/* The channel for gpionr, waits for the first channel that runs out of frames if none is idle.
+ * chan_idle may hold stale counts of channels that got a frame again, candidate() decides. */
+rmt_tx_chan_t* RmtTxDriver::wait_candidate(gpio_num_t gpionr, int timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    rmt_tx_chan_t* ch = candidate(gpionr);
+    while(ch == NULL)
+    {
+        TickType_t waited = xTaskGetTickCount() - start;
+        if(waited >= timeout || !xSemaphoreTake(chan_idle, timeout - waited))
+            return NULL;
+        ch = candidate(gpionr);
+    }
+    return ch;
+}
+
+/* Hand out the channels of the pool frame by frame. Only the render task transmits,
+ * the scheduler already sends the frames in the order of their deadlines.
+ * A strip takes the channel on its GPIO, else an idle one, else the first one that gets idle. */
+esp_err_t RmtTxDriver::transmit_pooled(gpio_num_t gpionr, const led_strip_frame_t* frame, SemaphoreHandle_t done, volatile int64_t* done_at, int timeout_ms)
 {
     if(lock(timeout_ms) != ESP_OK)
+    {
+        if(done)
+            xSemaphoreGive(done);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    rmt_tx_chan_t* ch = wait_candidate(gpionr, timeout_ms);
+    if(ch == NULL)
+    {
+        unlock();
+        if(done)
+            xSemaphoreGive(done);
         return ESP_ERR_TIMEOUT;
+    }
+    // an idle channel, or the one on this GPIO that needs no switch
+    switch_gpio(ch, gpionr, timeout_ms);
+    esp_err_t ret = queue(ch, frame, done, done_at);
+    unlock();
+    return ret;
+}
+
+esp_err_t RmtTxDriver::transmit(gpio_num_t gpionr, const led_strip_frame_t* frame, SemaphoreHandle_t done, volatile int64_t* done_at, int timeout_ms)
+{
+    if(nr_chan == 0)
+    {
+        if(done)
+            xSemaphoreGive(done);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if(synchro == NULL)
+        return transmit_pooled(gpionr, frame, done, done_at, timeout_ms);
 
-    if(gpionr != tx_chan_config.gpio_num)
+    if(lock(timeout_ms) != ESP_OK)
     {
-        ESP_ERROR_CHECK(rmt_disable(led_chan));
-        rmt_tx_switch_gpio(led_chan, gpionr, false);
-        tx_chan_config.gpio_num = gpionr;
-        ESP_ERROR_CHECK(rmt_enable(led_chan));
+        if(done)
+            xSemaphoreGive(done);
+        return ESP_ERR_TIMEOUT;
     }
 
-    esp_err_t ret = transmit(pixels, nr_pixels, timeout_ms);
+    flush_task = xTaskGetCurrentTaskHandle();
+    rmt_tx_chan_t* ch = find_channel(gpionr);
+    // the channel is a frame ahead of the others, don't wait for them any longer
+    if(ch->staged)
+        flush_staged();
+
+    ch->staged = true;
+    ch->staged_frame = frame;
+    ch->staged_done = done;
+    ch->staged_done_at = done_at;
+
+    bool all = true;
+    for(int i=0; i<nr_chan; i++)
+        all &= chan[i].staged;
+
+    if(all)
+        flush_staged();
+    else if(!esp_timer_is_active(sync_timer))
+        esp_timer_start_once(sync_timer, RMT_SYNC_WINDOW_US);
+
     unlock();
     taskYIELD();
-    return ret;
+    return ESP_OK;
 }
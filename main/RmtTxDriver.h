@@ -4,21 +4,72 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "driver/rmt_tx.h"
+#include "esp_timer.h"
+#include "soc/soc_caps.h"
+#include "led_strip_encoder.h"
 
-class RmtTxDriver {
-    rmt_channel_handle_t led_chan;
-    rmt_tx_channel_config_t tx_chan_config; 
+#define RMT_TX_QUEUE_DEPTH  4
+#define RMT_TX_PENDING_SIZE 8   // power of 2, > RMT_TX_QUEUE_DEPTH
+#define RMT_TX_MAX_CHANNELS SOC_RMT_TX_CANDIDATES_PER_GROUP
+
+class RmtTxDriver;
+
+// a queued transaction, on_trans_done gives done and sets done_at to the time it is on the wire
+typedef struct {
+    SemaphoreHandle_t done;
+    volatile int64_t* done_at;
+} rmt_tx_pending_t;
+
+typedef struct {
+    RmtTxDriver* drv;
+    rmt_channel_handle_t handle;
     rmt_encoder_handle_t led_encoder;
+    rmt_encoder_handle_t latch_encoder;     // sends only the reset code, for channels without a new frame
+    gpio_num_t gpio;
+
+    // the queued transactions, completed by on_trans_done in queue order
+    rmt_tx_pending_t pending[RMT_TX_PENDING_SIZE];
+    volatile uint32_t pending_head;
+    volatile uint32_t pending_tail;
+
+    // frame waiting for the synchronized start of all channels
+    bool staged;
+    const led_strip_frame_t* staged_frame;
+    SemaphoreHandle_t staged_done;
+    volatile int64_t* staged_done_at;
+} rmt_tx_chan_t;
+
+class RmtTxDriver {
+    rmt_tx_chan_t chan[RMT_TX_MAX_CHANNELS];
+    int nr_chan;
+    rmt_sync_manager_handle_t synchro;
+    esp_timer_handle_t sync_timer;
+    volatile bool sync_expired;     // the sync window timed out, the transmitting task flushes
+    TaskHandle_t flush_task;        // task that transmits the synchronized frames
+    rmt_tx_channel_config_t tx_chan_config;
     rmt_transmit_config_t tx_config;
     SemaphoreHandle_t mutex;
+    SemaphoreHandle_t chan_idle;    // pool: given by on_trans_done when a channel runs out of frames
+
+    static bool on_trans_done(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *user_ctx);
+    static void on_sync_timeout(void* arg);
+    esp_err_t new_channel(gpio_num_t gpionr);
+    rmt_tx_chan_t* find_channel(gpio_num_t gpionr);
+    rmt_tx_chan_t* candidate(gpio_num_t gpionr);
+    void switch_gpio(rmt_tx_chan_t* ch, gpio_num_t gpionr, int timeout_ms);
+    rmt_tx_chan_t* wait_candidate(gpio_num_t gpionr, int timeout_ms);
+    esp_err_t transmit_pooled(gpio_num_t gpionr, const led_strip_frame_t* frame, SemaphoreHandle_t done, volatile int64_t* done_at, int timeout_ms);
+    esp_err_t queue(rmt_tx_chan_t* ch, const led_strip_frame_t* frame, SemaphoreHandle_t done, volatile int64_t* done_at);
+    void flush_staged();
 
 public:
     RmtTxDriver();
     ~RmtTxDriver();
 
-    esp_err_t init(gpio_num_t gpionr);
-    esp_err_t transmit(gpio_num_t gpionr, uint8_t* pixels, size_t nr_pixels, int timeout_ms);
-    esp_err_t transmit(uint8_t* pixels, size_t nr_pixels, int timeout_ms);
+    esp_err_t init(const gpio_num_t* gpios, int nr_gpios, bool sync);
+    esp_err_t transmit(gpio_num_t gpionr, const led_strip_frame_t* frame, SemaphoreHandle_t done, volatile int64_t* done_at, int timeout_ms);
     esp_err_t lock(int timeout_ms);
     void unlock();
-};
\ No newline at end of file
+    void poll();
+    static void c_poll(void* arg) { ((RmtTxDriver*)arg)->poll(); }
+};
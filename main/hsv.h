@@ -0,0 +1,50 @@
+/* hsv.h
+   Integer HSV to RGB conversion, same results on every target with or without FPU
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HSV_HUE_STEPS   1536    // 6 sectors of 256 steps, 0 = red, 512 = green, 1024 = blue
+#define HSV_HUE_DEG(d)  ((uint32_t)(d) * HSV_HUE_STEPS / 360)
+
+// round(a * b / 255)
+static inline uint8_t hsv_scale8(uint8_t a, uint8_t b)
+{
+    uint32_t x = (uint32_t)a * b + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/**
+ * @brief Convert HSV to RGB
+ *
+ * @param h hue, 0 ... HSV_HUE_STEPS - 1, larger values wrap around
+ * @param s saturation, 0 ... 255
+ * @param v value, 0 ... 255
+ */
+static inline void hsv2rgb(uint32_t h, uint8_t s, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+    // which of max, min, rising, falling each of r, g, b gets in the 6 sectors
+    static const uint8_t sector_sel[6][3] = {
+        { 0, 2, 1 }, { 3, 0, 1 }, { 1, 0, 2 }, { 1, 3, 0 }, { 2, 1, 0 }, { 0, 1, 3 },
+    };
+
+    h %= HSV_HUE_STEPS;
+    uint8_t f = h & 0xff;
+    uint8_t min = v - hsv_scale8(v, s);
+    uint8_t adj = hsv_scale8(v - min, f);
+    const uint8_t level[4] = { v, min, (uint8_t)(min + adj), (uint8_t)(v - adj) };
+    const uint8_t *sel = sector_sel[h >> 8];
+    *r = level[sel[0]];
+    *g = level[sel[1]];
+    *b = level[sel[2]];
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,123 +4,146 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <string.h>
 #include "esp_check.h"
 #include "led_strip_encoder.h"
 
 static const char *TAG = "led_encoder";
 
-typedef struct {
-    rmt_encoder_t base;
-    rmt_encoder_t *bytes_encoder;
-    rmt_encoder_t *copy_encoder;
-    int state;
-    rmt_symbol_word_t reset_code;
-} rmt_led_strip_encoder_t;
+#define SYMBOLS_PER_LED 24
 
+// RMT symbols of all byte values, shared by all channels (same resolution)
+static rmt_symbol_word_t byte_symbols[256][8];
+static rmt_symbol_word_t reset_code;
+
+/* Encodes count LEDs of the frame, starting at its physical LED l */
 RMT_ENCODER_FUNC_ATTR
-static size_t rmt_encode_led_strip(rmt_encoder_t *encoder, rmt_channel_handle_t channel, const void *primary_data, size_t data_size, rmt_encode_state_t *ret_state)
+static size_t encode_leds(const led_strip_frame_t *frame, uint32_t l, uint32_t count, rmt_symbol_word_t *symbols)
 {
-    rmt_led_strip_encoder_t *led_encoder = __containerof(encoder, rmt_led_strip_encoder_t, base);
-    rmt_encoder_handle_t bytes_encoder = led_encoder->bytes_encoder;
-    rmt_encoder_handle_t copy_encoder = led_encoder->copy_encoder;
-    rmt_encode_state_t session_state = RMT_ENCODING_RESET;
-    rmt_encode_state_t state = RMT_ENCODING_RESET;
-    size_t encoded_symbols = 0;
-    switch (led_encoder->state) {
-    case 0: // send RGB data
-        encoded_symbols += bytes_encoder->encode(bytes_encoder, channel, primary_data, data_size, &session_state);
-        if (session_state & RMT_ENCODING_COMPLETE) {
-            led_encoder->state = 1; // switch to next state when current encoding session finished
-        }
-        if (session_state & RMT_ENCODING_MEM_FULL) {
-            state |= RMT_ENCODING_MEM_FULL;
-            goto out; // yield if there's no free space for encoding artifacts
-        }
-    // fall-through
-    case 1: // send reset code
-        encoded_symbols += copy_encoder->encode(copy_encoder, channel, &led_encoder->reset_code,
-                                                sizeof(led_encoder->reset_code), &session_state);
-        if (session_state & RMT_ENCODING_COMPLETE) {
-            led_encoder->state = RMT_ENCODING_RESET; // back to the initial encoding session
-            state |= RMT_ENCODING_COMPLETE;
+    uint32_t num_leds = frame->num_leds;
+    uint32_t f = frame->frac;
+    // logical LED shown by this physical LED
+    uint32_t i = l >= frame->offset ? l - frame->offset : l + num_leds - frame->offset;
+    size_t n = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        const uint8_t *px = &frame->pixels[led_strip_pixel_index(frame, i) * 3];
+        if (f) {
+            // sub-LED position: mix in the LED that moves in here next, none at the start of a strip that does not wrap
+            const uint8_t *prev = px;
+            if (i || frame->wrap) {
+                prev = &frame->pixels[led_strip_pixel_index(frame, i ? i - 1 : num_leds - 1) * 3];
+            }
+            for (int c = 0; c < 3; c++) {
+                uint8_t v = frame->lut[c][(px[c] * (256 - f) + prev[c] * f) >> 8];
+                memcpy(&symbols[n], byte_symbols[v], sizeof(byte_symbols[v]));
+                n += 8;
+            }
+        } else {
+            for (int c = 0; c < 3; c++) {
+                uint8_t v = frame->lut[c][px[c]];
+                memcpy(&symbols[n], byte_symbols[v], sizeof(byte_symbols[v]));
+                n += 8;
+            }
         }
-        if (session_state & RMT_ENCODING_MEM_FULL) {
-            state |= RMT_ENCODING_MEM_FULL;
-            goto out; // yield if there's no free space for encoding artifacts
+        if (++i == num_leds) {
+            i = 0;
         }
     }
-out:
-    *ret_state = state;
-    return encoded_symbols;
-}
-
-static esp_err_t rmt_del_led_strip_encoder(rmt_encoder_t *encoder)
-{
-    rmt_led_strip_encoder_t *led_encoder = __containerof(encoder, rmt_led_strip_encoder_t, base);
-    rmt_del_encoder(led_encoder->bytes_encoder);
-    rmt_del_encoder(led_encoder->copy_encoder);
-    free(led_encoder);
-    return ESP_OK;
+    return n;
 }
 
+/* Called by the simple encoder whenever there is room in the RMT memory.
+ * symbols_written tells how far the frame got, whole LEDs are encoded per call. */
 RMT_ENCODER_FUNC_ATTR
-static esp_err_t rmt_led_strip_encoder_reset(rmt_encoder_t *encoder)
+static size_t rmt_encode_led_strip(const void *data, size_t data_size, size_t symbols_written, size_t symbols_free,
+                                   rmt_symbol_word_t *symbols, bool *done, void *arg)
 {
-    rmt_led_strip_encoder_t *led_encoder = __containerof(encoder, rmt_led_strip_encoder_t, base);
-    rmt_encoder_reset(led_encoder->bytes_encoder);
-    rmt_encoder_reset(led_encoder->copy_encoder);
-    led_encoder->state = RMT_ENCODING_RESET;
-    return ESP_OK;
+    const led_strip_frame_t *frame = (const led_strip_frame_t *)data;
+    uint32_t num_send = frame->num_send;
+    uint32_t led = symbols_written / SYMBOLS_PER_LED;
+
+    if (led >= num_send) {
+        if (symbols_free < 1) {
+            return 0;
+        }
+        symbols[0] = reset_code;
+        *done = true;
+        return 1;
+    }
+
+    // frame of this LED, base is the first LED of the frame
+    uint32_t base = 0;
+    while (frame && led - base >= frame->num_leds) {
+        base += frame->num_leds;
+        frame = frame->next;
+    }
+
+    size_t n = 0;
+    while (led < num_send && symbols_free - n >= SYMBOLS_PER_LED) {
+        if (frame == NULL) {
+            // behind the last frame
+            for (int c = 0; c < 3; c++) {
+                memcpy(&symbols[n], byte_symbols[0], sizeof(byte_symbols[0]));
+                n += 8;
+            }
+            led++;
+            continue;
+        }
+
+        uint32_t count = frame->num_leds - (led - base);
+        if (count > num_send - led) {
+            count = num_send - led;
+        }
+        if (count > (symbols_free - n) / SYMBOLS_PER_LED) {
+            count = (symbols_free - n) / SYMBOLS_PER_LED;
+        }
+        n += encode_leds(frame, led - base, count, &symbols[n]);
+        led += count;
+        if (led - base == frame->num_leds) {
+            base += frame->num_leds;
+            frame = frame->next;
+        }
+    }
+    return n;
 }
 
 esp_err_t rmt_new_led_strip_encoder(const led_strip_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder)
 {
-    esp_err_t ret = ESP_OK;
-    rmt_led_strip_encoder_t *led_encoder = NULL;
-    ESP_GOTO_ON_FALSE(config && ret_encoder, ESP_ERR_INVALID_ARG, err, TAG, "invalid argument");
-    led_encoder = rmt_alloc_encoder_mem(sizeof(rmt_led_strip_encoder_t));
-    ESP_GOTO_ON_FALSE(led_encoder, ESP_ERR_NO_MEM, err, TAG, "no mem for led strip encoder");
-    led_encoder->base.encode = rmt_encode_led_strip;
-    led_encoder->base.del = rmt_del_led_strip_encoder;
-    led_encoder->base.reset = rmt_led_strip_encoder_reset;
+    ESP_RETURN_ON_FALSE(config && ret_encoder, ESP_ERR_INVALID_ARG, TAG, "invalid argument");
+
     // different led strip might have its own timing requirements, following parameter is for WS2812
-    rmt_bytes_encoder_config_t bytes_encoder_config = {
-        .bit0 = {
-            .level0 = 1,
-            .duration0 = 0.3 * config->resolution / 1000000, // T0H=0.3us
-            .level1 = 0,
-            .duration1 = 0.9 * config->resolution / 1000000, // T0L=0.9us
-        },
-        .bit1 = {
-            .level0 = 1,
-            .duration0 = 0.9 * config->resolution / 1000000, // T1H=0.9us
-            .level1 = 0,
-            .duration1 = 0.3 * config->resolution / 1000000, // T1L=0.3us
-        },
-        .flags.msb_first = 1 // WS2812 transfer bit order: G7...G0R7...R0B7...B0
+    const rmt_symbol_word_t bit0 = {
+        .duration0 = 0.3 * config->resolution / 1000000, // T0H=0.3us
+        .level0 = 1,
+        .duration1 = 0.9 * config->resolution / 1000000, // T0L=0.9us
+        .level1 = 0,
     };
-    ESP_GOTO_ON_ERROR(rmt_new_bytes_encoder(&bytes_encoder_config, &led_encoder->bytes_encoder), err, TAG, "create bytes encoder failed");
-    rmt_copy_encoder_config_t copy_encoder_config = {};
-    ESP_GOTO_ON_ERROR(rmt_new_copy_encoder(&copy_encoder_config, &led_encoder->copy_encoder), err, TAG, "create copy encoder failed");
+    const rmt_symbol_word_t bit1 = {
+        .duration0 = 0.9 * config->resolution / 1000000, // T1H=0.9us
+        .level0 = 1,
+        .duration1 = 0.3 * config->resolution / 1000000, // T1L=0.3us
+        .level1 = 0,
+    };
+    // WS2812 transfer bit order: G7...G0R7...R0B7...B0
+    for (int v = 0; v < 256; v++) {
+        for (int b = 0; b < 8; b++) {
+            byte_symbols[v][b] = (v & (0x80 >> b)) ? bit1 : bit0;
+        }
+    }
 
     uint32_t reset_ticks = config->resolution / 1000000 * 50 / 2; // reset code duration defaults to 50us
-    led_encoder->reset_code = (rmt_symbol_word_t) {
-        .level0 = 0,
+    reset_code = (rmt_symbol_word_t) {
         .duration0 = reset_ticks,
-        .level1 = 0,
+        .level0 = 0,
         .duration1 = reset_ticks,
+        .level1 = 0,
+    };
+
+    rmt_simple_encoder_config_t simple_encoder_config = {
+        .callback = rmt_encode_led_strip,
+        .arg = NULL,
+        .min_chunk_size = SYMBOLS_PER_LED,
     };
-    *ret_encoder = &led_encoder->base;
+    ESP_RETURN_ON_ERROR(rmt_new_simple_encoder(&simple_encoder_config, ret_encoder), TAG, "create simple encoder failed");
     return ESP_OK;
-err:
-    if (led_encoder) {
-        if (led_encoder->bytes_encoder) {
-            rmt_del_encoder(led_encoder->bytes_encoder);
-        }
-        if (led_encoder->copy_encoder) {
-            rmt_del_encoder(led_encoder->copy_encoder);
-        }
-        free(led_encoder);
-    }
-    return ret;
 }
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "driver/rmt_encoder.h"
 
 #ifdef __cplusplus
@@ -19,6 +20,46 @@ typedef struct {
     uint32_t resolution; /*!< Encoder resolution, in Hz */
 } led_strip_encoder_config_t;
 
+/**
+ * @brief Frame handed to rmt_transmit() as payload of the led strip encoder
+ *
+ * The encoder reads the pixels in place and maps them to the physical LEDs while encoding.
+ * Frames can be chained, each one drives the LEDs behind the previous one.
+ * The frames must stay unchanged until the transmission is done.
+ */
+typedef struct led_strip_frame_s led_strip_frame_t;
+struct led_strip_frame_s {
+    const uint8_t *pixels;  /*!< GRB bytes, 3 per LED, in logical order */
+    uint32_t num_leds;      /*!< Number of LEDs in the strip, or of this part of it */
+    uint32_t num_send;      /*!< Send only this many physical LEDs, the others keep their colors.
+                                 Counts the LEDs of all chained frames, only used in the first one.
+                                 LEDs behind the last frame are sent dark. */
+    uint32_t offset;        /*!< Physical LED that shows the first logical LED */
+    bool reverse;           /*!< Logical LEDs run backwards along the strip */
+    uint32_t mirror;        /*!< If > 0: LED j shows the pixel at distance |j - mirror| from ring */
+    uint32_t ring;          /*!< Start of the ring of mirror + 1 pixels */
+    uint8_t frac;           /*!< If > 0: moved this far (of 256) past offset, each LED is blended with the LED before */
+    bool wrap;              /*!< The pixels run around the strip, the first LED blends with the last one */
+    const uint8_t (*lut)[256]; /*!< Output table per color byte (G, R, B), applied to every pixel */
+    const led_strip_frame_t *next; /*!< Frame of the following LEDs, or NULL */
+};
+
+/**
+ * @brief Index in frame->pixels (in LEDs) of the i-th LED after the offset
+ */
+static inline uint32_t led_strip_pixel_index(const led_strip_frame_t *frame, uint32_t i)
+{
+    uint32_t j = frame->reverse ? frame->num_leds - 1 - i : i;
+    if (frame->mirror) {
+        uint32_t d = j >= frame->mirror ? j - frame->mirror : frame->mirror - j;
+        j = frame->ring + d;
+        if (j > frame->mirror) {
+            j -= frame->mirror + 1;
+        }
+    }
+    return j;
+}
+
 /**
  * @brief Create RMT encoder for encoding LED strip pixels into RMT symbols
  *
@@ -14,6 +14,7 @@
 
 #include "wifi.h"
 #include "sntp.h"
+#include "timesvc.h"
 #include "webserver.h"
 #include "file_server.h"
 
@@ -23,7 +24,8 @@ static EventGroupHandle_t s_wifi_event_group;
 
 extern "C" void app_main(void)
 {
-    Webserver webserver;
+    // the strips and the buffers of the server are too big for the stack of the main task
+    static Webserver webserver;
     bool softap_mode = false;
     bool connected = false;
 
@@ -46,6 +48,7 @@ extern "C" void app_main(void)
     ESP_ERROR_CHECK(esp_event_loop_create_default() );
 
     ESP_ERROR_CHECK(mount_storage(spiffs_path));
+    timesvc_start();
     ESP_ERROR_CHECK(webserver.init_leds(spiffs_path));
     ESP_ERROR_CHECK(webserver.start(spiffs_path));
 
@@ -18,6 +18,7 @@
 #include "esp_netif_sntp.h"
 #include "lwip/ip_addr.h"
 #include "esp_sntp.h"
+#include "timesvc.h"
 
 static const char *TAG = "sntp";
 
@@ -66,6 +67,7 @@ void sntp_sync_time(struct timeval *tv)
 void time_sync_notification_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "Notification of a time synchronization event");
+    timesvc_notify_sync();
 }
 
 void sntp_start(void)
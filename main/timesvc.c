@@ -0,0 +1,103 @@
+/* timesvc.c
+   One cached local time for all effects. localtime_r() runs once per second in the
+   esp_timer task, at the start of every second, instead of in every frame of every strip.
+*/
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "timesvc.h"
+
+static const char *TAG = "timesvc";
+
+static esp_timer_handle_t s_timer = NULL;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static timesvc_t s_now;
+static int64_t s_sec_start_ms;      // timesvc_ms() when s_now.sec began
+static bool s_synced = false;
+
+// read the clock, returns the microseconds to the next second
+static int64_t refresh(void)
+{
+    struct timeval tv;
+    struct tm local;
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &local);
+    int64_t start_ms = timesvc_ms() - tv.tv_usec / 1000;
+
+    portENTER_CRITICAL(&s_lock);
+    s_now.sec = tv.tv_sec;
+    s_now.local = local;
+    // the clock is set if it is past 2016, as in sntp_start()
+    s_now.valid = s_synced || local.tm_year >= (2016 - 1900);
+    s_sec_start_ms = start_ms;
+    portEXIT_CRITICAL(&s_lock);
+
+    return 1000000 - tv.tv_usec;
+}
+
+static void on_second(void *arg)
+{
+    int64_t next = refresh();
+    esp_timer_start_once(s_timer, next);
+}
+
+void timesvc_start(void)
+{
+    if (s_timer) {
+        return;
+    }
+    esp_timer_create_args_t timer_args = {
+        .callback = on_second,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "timesvc",
+        .skip_unhandled_events = true,
+    };
+    if (esp_timer_create(&timer_args, &s_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "could not create the timer, the time is read on every call");
+        s_timer = NULL;
+        return;
+    }
+    on_second(NULL);
+}
+
+void timesvc_get(timesvc_t *t)
+{
+    if (s_timer == NULL) {
+        refresh();
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    *t = s_now;
+    int64_t ms = timesvc_ms() - s_sec_start_ms;
+    portEXIT_CRITICAL(&s_lock);
+
+    // the timer may run a little late, the next second is not known before it ran
+    t->ms = ms < 0 ? 0 : (ms > 999 ? 999 : ms);
+}
+
+// SNTP set the clock, it may have jumped
+void timesvc_notify_sync(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_synced = true;
+    s_now.sync_gen++;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (s_timer) {
+        esp_timer_stop(s_timer);
+        on_second(NULL);
+    } else {
+        refresh();
+    }
+    ESP_LOGI(TAG, "clock synced");
+}
+
+uint32_t timesvc_sync_gen(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint32_t gen = s_now.sync_gen;
+    portEXIT_CRITICAL(&s_lock);
+    return gen;
+}
@@ -0,0 +1,37 @@
+/* timesvc.h
+   One cached local time for all effects, updated once per second
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "esp_timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    time_t sec;             // seconds since the epoch
+    struct tm local;        // broken-down local time of sec
+    uint32_t ms;            // into the second, interpolated with the monotonic clock
+    bool valid;             // the clock was set, by SNTP or before a restart
+    uint32_t sync_gen;      // counts the SNTP syncs, a change means the clock may have jumped
+} timesvc_t;
+
+void timesvc_start(void);
+void timesvc_get(timesvc_t *t);
+void timesvc_notify_sync(void);
+uint32_t timesvc_sync_gen(void);
+
+// monotonic milliseconds since boot, not affected by SNTP
+static inline int64_t timesvc_ms(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -56,8 +56,13 @@ static esp_err_t c_led_power_handler(httpd_req_t *req);
 static esp_err_t c_led_strip_handler(httpd_req_t *req);
 static esp_err_t c_get_wifi_handler(httpd_req_t *req);
 static esp_err_t c_set_wifi_handler(httpd_req_t *req);
+#if CONFIG_LED_WEBSOCKET
+static esp_err_t c_ws_handler(httpd_req_t *req);
+#endif
+
+#define WS_PUSH_DELAY_US    (1000000 / CONFIG_LED_FRAME_RATE)
 
-const websvr_table_t Webserver::websvr_table[] = {
+constexpr websvr_table_t Webserver::websvr_table[] = {
     { URI_SPEED,  "/speed",     c_led_get_handler },
     { URI_LED,    "/led",       c_led_get_handler },
     { URI_VALUES, "/values",    c_led_val_handler },
@@ -74,7 +79,14 @@ Webserver::Webserver()
 {
     server = NULL;
     stripnr = 0;
+    segnr = 0;
+    canvas_path[0] = 0;
     colorcnt = 0;
+    push_timer = NULL;
+    nr_preview = 0;
+    preview_strip = NULL;
+    preview_timer = NULL;
+    preview_queued = false;
 }
 
 Webserver::~Webserver()
@@ -261,37 +273,140 @@ static esp_err_t c_set_wifi_handler(httpd_req_t *req)
     return webserver->set_wifi_handler(req);
 }
 
-bool Webserver::parse_stripnr(httpd_req_t *req)
+// the path of the uri is one of the routes, exactly
+static bool route_is(const char* uri, size_t len, const char* route)
+{
+    return strncmp(uri, route, len) == 0 && route[len] == 0;
+}
+
+// the effect selected by the uri, nullptr for the other routes
+static const ledfunc_table_t* route_effect(const char* uri)
+{
+    size_t len = strcspn(uri, "?");
+    for(int i=0; Ledstrip::ledfunc_table[i].algo; i++)
+    {
+        if(route_is(uri, len, Ledstrip::ledfunc_table[i].uri))
+            return &Ledstrip::ledfunc_table[i];
+    }
+    return nullptr;
+}
+
+websvr_uri_t Webserver::route_type(const char* uri)
+{
+    size_t len = strcspn(uri, "?");
+    for(int i=0; websvr_table[i].type; i++)
+    {
+        if(route_is(uri, len, websvr_table[i].uri))
+            return websvr_table[i].type;
+    }
+    return URI_END;
+}
+
+#if CONFIG_LED_WEBSOCKET
+static esp_err_t c_ws_handler(httpd_req_t *req)
+{
+    Webserver* webserver = (Webserver*)req->user_ctx;
+    return webserver->ws_handler(req);
+}
+#endif
+
+bool Webserver::parse_stripnr()
 {
     bool changed = false;
     uint32_t nr = 0;
-    if (query_key_nr(req, "strip", &nr)) {
-        if(nr < NR_LEDSTRIPS && stripnr != nr) {
+    if (query.get_nr("strip", &nr)) {
+        // the canvas is the strip behind the last one
+        uint32_t nr_strips = NR_LEDSTRIPS + (canvas.canvas_size() > 0 ? 1 : 0);
+        if(nr < nr_strips && stripnr != nr) {
             stripnr = nr;
+            segnr = 0;
+            changed = true;
+        }
+    }
+    if (query.get_nr("seg", &nr)) {
+        if(segnr != nr) {
+            segnr = nr;
             changed = true;
         }
     }
     return changed;
 }
 
-/* An HTTP GET handler */
-esp_err_t Webserver::led_get_handler(httpd_req_t *req)
+// the selected strip, or its selected segment
+Ledstrip* Webserver::selected()
+{
+    if(stripnr >= NR_LEDSTRIPS)
+        return &canvas;
+    Ledstrip* led = ledstrip[stripnr].segment(segnr - 1);
+    return led ? led : &ledstrip[stripnr];
+}
+
+// nr: strip numbers in the order of the canvas, n = 0 ends the canvas
+esp_err_t Webserver::set_canvas(const uint32_t* nr, int n)
 {
-    bool strip_changed = parse_stripnr(req);
-    led_config_t* cfg = &ledstrip[stripnr].cfg;
+    Ledstrip* strips[LED_MAX_CANVAS];
+    if(n > LED_MAX_CANVAS)
+        return ESP_ERR_INVALID_ARG;
+    // the settings form sends the canvas every time, rebuilding it would restart all its strips
+    string list;
+    for(int i=0; i<n; i++)
+        list += (i ? "," : "") + to_string(nr[i]);
+    if(list == canvas_strips && n == canvas.canvas_size())
+        return ESP_OK;
+    for(int i=0; i<n; i++)
+    {
+        if(nr[i] >= NR_LEDSTRIPS)
+            return ESP_ERR_INVALID_ARG;
+        strips[i] = &ledstrip[nr[i]];
+    }
+    esp_err_t ret = canvas.set_canvas(strips, n);
+    if(ret != ESP_OK)
+        return ret;
+
+    FILE* f = fopen(canvas_path, "w");
+    if(f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s for writing", canvas_path);
+        return ESP_FAIL;
+    }
+    fwrite(nr, sizeof(uint32_t), n, f);
+    fclose(f);
+
+    canvas_strips = list;
+    return ESP_OK;
+}
+
+static uint8_t full_bright(uint32_t val, uint32_t bright)
+{
+    if(bright == 0 || bright >= 100)
+        return (uint8_t)val;
+
+    val = val * 100 / bright;
+    return val > 255 ? 255 : (uint8_t)val;
+}
+
+/* Applies a control uri, from a GET request or a WebSocket message, e.g. /led?red=255
+ * true if another strip was selected */
+bool Webserver::led_control(const char* uri)
+{
+    query.parse_uri(uri);
+    bool strip_changed = parse_stripnr();
+    Ledstrip* led = selected();
+    led_config_t* cfg = &led->cfg;
+    const ledfunc_table_t* fx = Ledstrip::effect(cfg->algorithm);
 
     bool bright_changed = false;
     /* Get value of expected key from query string */
     uint32_t bright = 0;
-    if (query_key_nr(req, "bright", &bright)) {
+    if (query.get_nr("bright", &bright)) {
         if(bright != cfg->bright) {
             cfg->bright = bright;
             bright_changed = true;
         }
     }
-    if(!bright_changed || cfg->algorithm == ALGO_MONO) {
+    if(!bright_changed || (fx->flags & EFFECT_STATIC)) {
         color_t* color = &cfg->color1;
-        if(cfg->algorithm == ALGO_CLOCK2) {
+        if(fx->flags & EFFECT_COLOR2) {
             if(colorcnt == 1) {
                 colorcnt = 0;
                 color = &cfg->color2;
@@ -300,51 +415,48 @@ esp_err_t Webserver::led_get_handler(httpd_req_t *req)
         }
         else colorcnt = 0;
         
+        // the color wheel sends colors darkened by the brightness, which is applied by the output stage
         uint32_t val = 0;
-        if (query_key_nr(req, "red", &val)) {
-            color->red = (uint8_t)val;
+        if (query.get_nr("red", &val)) {
+            color->red = full_bright(val, cfg->bright);
         }
-        if (query_key_nr(req, "green", &val)) {
-            color->green = (uint8_t)val;
+        if (query.get_nr("green", &val)) {
+            color->green = full_bright(val, cfg->bright);
         }
-        if (query_key_nr(req, "blue", &val)) {
-            color->blue = (uint8_t)val;
+        if (query.get_nr("blue", &val)) {
+            color->blue = full_bright(val, cfg->bright);
         }
     }
-    query_key_nr(req, "speed", &cfg->speed);
+    query.get_nr("speed", &cfg->speed);
 
-    for(int i=0; Ledstrip::ledfunc_table[i].algo; i++)
-    {
-        if(string(req->uri).find(Ledstrip::ledfunc_table[i].uri) != string::npos)
-        {
-            cfg->algorithm = Ledstrip::ledfunc_table[i].algo;
-            if(cfg->algorithm == ALGO_GRADIENT || cfg->algorithm == ALGO_WALK)
-            {
-                ledstrip[stripnr].dark();
-                ledstrip[stripnr].firstled(cfg->color1);
-            }
-        }
+    // text of the ticker, empty for the time
+    char text[64];
+    if (query.get_str("text", text, sizeof(text))) {
+        led->set_text(text);
     }
 
-    for(int i=0; websvr_table[i].type; i++)
+    const ledfunc_table_t* route = route_effect(uri);
+    if(route)
     {
-        if(string(req->uri).find(websvr_table[i].uri) != string::npos)
-        { 
-            if(websvr_table[i].type == URI_LED && cfg->algorithm == ALGO_WALK)
-            {
-                ledstrip[stripnr].firstled(cfg->color1);
-            }
-            else if(websvr_table[i].type == URI_LED && cfg->algorithm == ALGO_GRADIENT)
-            {
-                ledstrip[stripnr].add_gradient(cfg->color1);
-            }
-        }
+        cfg->algorithm = route->algo;
+        // painted effects start from a dark strip with the current color
+        led->paint(cfg->color1, true);
+    }
+    else if(route_type(uri) == URI_LED)
+    {
+        led->paint(cfg->color1, false);
     }
 
-    ledstrip[stripnr].switchNow();
-    ledstrip[stripnr].saveConfig();
+    led->switchNow();
+    led->saveConfig();
+    push_state();
+    return strip_changed;
+}
 
-    if(strip_changed) {
+/* An HTTP GET handler */
+esp_err_t Webserver::led_get_handler(httpd_req_t *req)
+{
+    if(led_control(req->uri)) {
         string result = "RELOAD";
         httpd_resp_send(req, result.c_str(), result.length());
     }
@@ -358,22 +470,108 @@ esp_err_t Webserver::led_get_handler(httpd_req_t *req)
 /* An HTTP GET handler */
 esp_err_t Webserver::led_set_handler(httpd_req_t *req)
 {
-    parse_stripnr(req);
-    led_config_t* cfg = &ledstrip[stripnr].cfg;
+    query.parse(req);
+    parse_stripnr();
+    Ledstrip* led = selected();
+    led_config_t* cfg = &led->cfg;
 
     /* Get value of expected key from query string */
-    query_key_nr(req, "nr_leds", &cfg->num_leds);
-    query_key_nr(req, "led1", &cfg->led1);
-    query_key_nr(req, "fadein", &cfg->fadein_ms);
+    // the length of a segment is set by the segments of its strip
+    if (!led->is_segment()) {
+        query.get_nr("nr_leds", &cfg->num_leds);
+    }
+    query.get_nr("led1", &cfg->led1);
+    query.get_nr("fadein", &cfg->fadein_ms);
+    uint32_t gamma = 0;
+    if (query.get_nr("gamma", &gamma) && gamma >= 10 && gamma <= 30) {
+        cfg->gamma = gamma;
+    }
+
+    char white[10] = { 0 };
+    if (query.get_str("white", white, sizeof(white)) && white[0] == '#') {
+        uint32_t rgb = strtoul(white + 1, NULL, 16);
+        cfg->white.red = rgb >> 16;
+        cfg->white.green = rgb >> 8;
+        cfg->white.blue = rgb;
+    }
 
     char side[10] = { 0 };
-    query_key_str(req, "rotate", side, sizeof(side));
-    if (query_key_str(req, "rotate", side, sizeof(side))) {
+    if (query.get_str("rotate", side, sizeof(side))) {
         cfg->counterclock = string(side) == "left";
     }
-    query_key_str(req, "stripname", cfg->name, sizeof(cfg->name));
+    query.get_str("stripname", cfg->name, sizeof(cfg->name));
+
+    // strips of the canvas in their order, e.g. "0,1,2", empty for none
+    char strips[4 * LED_MAX_CANVAS] = { 0 };
+    if (query.get_str("canvas", strips, sizeof(strips))) {
+        uint32_t nr[LED_MAX_CANVAS];
+        int n = 0;
+        char* p = strips;
+        while (*p && n < LED_MAX_CANVAS) {
+            nr[n++] = strtoul(p, &p, 10);
+            if (*p == ',')
+                p++;
+        }
+        if (set_canvas(nr, n) == ESP_OK && stripnr >= NR_LEDSTRIPS && n == 0) {
+            stripnr = 0;
+            led = &ledstrip[stripnr];
+        }
+    }
+
+    // matrix layout, e.g. "16x16", empty for one row, "points" for a point list uploaded as a file
+    char matrix[16] = { 0 };
+    if (query.get_str("matrix", matrix, sizeof(matrix))) {
+        char points[32] = { 0 };
+        char wiring[16] = { 0 };
+        char origin[4] = { 0 };
+        query.get_str("wiring", wiring, sizeof(wiring));
+        query.get_str("origin", origin, sizeof(origin));
+        uint32_t flags = 0;
+        if (strncmp(wiring, "zigzag", 6) == 0)
+            flags |= LAYOUT_SERPENTINE;
+        if (strstr(wiring, "_cols"))
+            flags |= LAYOUT_COLUMNS;
+        if (origin[0] == 'b')
+            flags |= LAYOUT_BOTTOM;
+        if (origin[0] && origin[1] == 'r')
+            flags |= LAYOUT_RIGHT;
+
+        const layout_config_t& lc = led->layout_cfg();
+        unsigned w = 0, h = 0;
+        if (query.get_str("points", points, sizeof(points)) && points[0]) {
+            led->set_points((base_path + "/" + points).c_str());
+        }
+        else if (string(matrix) != "points" && (matrix[0] == 0 || (sscanf(matrix, "%ux%u", &w, &h) == 2 && w <= UINT16_MAX && h <= UINT16_MAX &&
+                 w * h <= LAYOUT_CELLS_PER_LED * cfg->num_leds)) &&
+                 (w != lc.width || h != lc.height || flags != lc.flags)) {
+            led->set_matrix(w, h, flags);
+        }
+    }
+
+    // lengths of the segments, e.g. "60,240", empty for none
+    esp_err_t seg_ret = ESP_OK;
+    char segments[8 * LED_MAX_SEGMENTS] = { 0 };
+    if (stripnr < NR_LEDSTRIPS && !led->is_segment() && query.get_str("segments", segments, sizeof(segments))) {
+        uint32_t len[LED_MAX_SEGMENTS];
+        int n = 0;
+        char* p = segments;
+        while (*p && n < LED_MAX_SEGMENTS) {
+            len[n++] = strtoul(p, &p, 10);
+            if (*p == ',')
+                p++;
+        }
+        seg_ret = ledstrip[stripnr].set_segments(len, n);
+        segnr = 0;
+        led = &ledstrip[stripnr];
+    }
+
+    led->saveConfig();
+    push_state();
 
-    ledstrip[stripnr].saveConfig();
+    if (seg_ret == ESP_ERR_INVALID_STATE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "A strip of the canvas can not have segments");
+        return ESP_OK;
+    }
 
     string redirect = "<meta http-equiv=\"refresh\" content=\"0; url=/index.html\" />";
     httpd_resp_send(req, redirect.c_str(), redirect.length());
@@ -400,11 +598,12 @@ esp_err_t Webserver::set_wifi_handler(httpd_req_t *req)
 {
     wifi_config_file_t cfg = { .ssid="", .pwd="", .use_ap=false };
     char ap[16];
-    if(query_key_str(req, "ap", ap, sizeof(ap)) && strcmp(ap, "on"))
+    query.parse(req);
+    if(query.get_str("ap", ap, sizeof(ap)) && strcmp(ap, "on"))
         cfg.use_ap = true;
 
-    if(query_key_str(req, "ssid", (char*)cfg.ssid, SSID_SIZE) &&
-       query_key_str(req, "password", (char*)cfg.pwd, PWD_SIZE)
+    if(query.get_str("ssid", (char*)cfg.ssid, SSID_SIZE) &&
+       query.get_str("password", (char*)cfg.pwd, PWD_SIZE)
        ) {
         wifi_write_config(&cfg);
     }
@@ -415,21 +614,44 @@ esp_err_t Webserver::set_wifi_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+// the values of the selected strip, also pushed to the WebSocket clients
+string Webserver::state_json()
+{
+    Ledstrip* led = selected();
+    string json = led->to_json(led->cfg);
+    json.insert(json.length() - 1, "," +
+        Ledstrip::to_json("strip", stripnr) + "," +
+        Ledstrip::to_json("seg", segnr) + "," +
+        Ledstrip::to_json("power", led->cfg.power) + "," +
+        Ledstrip::to_json("canvas", canvas_strips) + "," + saver.to_json());
+    return json;
+}
+
 esp_err_t Webserver::led_val_handler(httpd_req_t *req)
 {
-    parse_stripnr(req);
-    string json = ledstrip[stripnr].to_json(ledstrip[stripnr].cfg);
+    query.parse(req);
+    parse_stripnr();
+    string json = state_json();
     
     httpd_resp_set_type(req, "application/json;charset=utf-8");
     httpd_resp_send(req, json.c_str(), json.length());
     return ESP_OK;
 }
 
-esp_err_t Webserver::led_power_handler(httpd_req_t *req)
+void Webserver::power()
 {
-    ledstrip[stripnr].onoff();
-    ledstrip[stripnr].saveConfig();
+    Ledstrip* led = selected();
+    led->onoff();
+    led->saveConfig();
+    // the LEDs may be unplugged after switching them off
+    if(!led->cfg.power)
+        saver.flush();
+    push_state();
+}
 
+esp_err_t Webserver::led_power_handler(httpd_req_t *req)
+{
+    power();
     httpd_resp_send(req, NULL, 0);
     /* After sending the HTTP response the old HTTP request headers are lost. */
     return ESP_OK;
@@ -438,7 +660,7 @@ esp_err_t Webserver::led_power_handler(httpd_req_t *req)
 esp_err_t Webserver::led_strip_handler(httpd_req_t *req)
 {
     string json = "{" + 
-        Ledstrip::to_json("nr_strips", NR_LEDSTRIPS) + "," +
+        Ledstrip::to_json("nr_strips", NR_LEDSTRIPS + (canvas.canvas_size() > 0 ? 1 : 0)) + "," +
         Ledstrip::to_json("selected_strip", stripnr) + "," +
         "\"name\":[";
 
@@ -449,12 +671,199 @@ esp_err_t Webserver::led_strip_handler(httpd_req_t *req)
 
         json += "\"" + string(ledstrip[i].cfg.name) + "\"";
     }
+    if(canvas.canvas_size() > 0)
+        json += ",\"" + string(canvas.cfg.name) + "\"";
     json += "]}";
     httpd_resp_set_type(req, "application/json;charset=utf-8");
     httpd_resp_send(req, json.c_str(), json.length());
     return esp_err_t();
 }
 
+#if CONFIG_LED_WEBSOCKET
+/* One control message per text frame, the same uri as for a GET request, e.g. /mono?red=255&green=0&blue=0
+ * Nothing is answered, the new state is pushed to all clients. */
+esp_err_t Webserver::ws_handler(httpd_req_t *req)
+{
+    if(req->method == HTTP_GET) {
+        ESP_LOGI(TAG, "WebSocket client %d connected", httpd_req_to_sockfd(req));
+        return ESP_OK;
+    }
+
+    httpd_ws_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if(ret != ESP_OK)
+        return ret;
+    if(frame.len >= sizeof(ws_msg)) {
+        // the rest of the frame would be taken for the next one, close the socket
+        ESP_LOGE(TAG, "WebSocket message of %d bytes is too long", (int)frame.len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    frame.payload = (uint8_t*)ws_msg;
+    ret = httpd_ws_recv_frame(req, &frame, sizeof(ws_msg) - 1);
+    if(ret != ESP_OK)
+        return ret;
+    ws_msg[frame.len] = 0;
+    if(frame.type != HTTPD_WS_TYPE_TEXT)
+        return ESP_OK;
+
+    websvr_uri_t type = route_type(ws_msg);
+    if(route_is(ws_msg, strcspn(ws_msg, "?"), "/preview")) {
+        uint32_t on = 0;
+        query.parse_uri(ws_msg);
+        query.get_nr("on", &on);
+        preview_client(httpd_req_to_sockfd(req), on);
+    }
+    else if(type == URI_POWER)
+        power();
+    else if(type == URI_LED || type == URI_SPEED || route_effect(ws_msg))
+        led_control(ws_msg);
+    else
+        ESP_LOGW(TAG, "WebSocket: unknown message %s", ws_msg);
+    return ESP_OK;
+}
+
+// the frames are sent by the httpd task, which owns the sockets
+void Webserver::c_push_timer(void* arg)
+{
+    Webserver* webserver = (Webserver*)arg;
+    if(webserver->server)
+        httpd_queue_work(webserver->server, c_push_work, webserver);
+}
+
+void Webserver::c_push_work(void* arg)
+{
+    Webserver* webserver = (Webserver*)arg;
+    webserver->send_state();
+}
+
+void Webserver::send_state()
+{
+    int fds[CONFIG_LWIP_MAX_SOCKETS];
+    size_t nr = sizeof(fds) / sizeof(fds[0]);
+    if(server == NULL || httpd_get_client_list(server, &nr, fds) != ESP_OK)
+        return;
+
+    string json;
+    for(size_t i=0; i<nr; i++)
+    {
+        if(httpd_ws_get_fd_info(server, fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET)
+            continue;
+        if(json.empty())
+            json = state_json();
+
+        httpd_ws_frame_t frame;
+        memset(&frame, 0, sizeof(frame));
+        frame.final = true;
+        frame.type = HTTPD_WS_TYPE_TEXT;
+        frame.payload = (uint8_t*)json.data();
+        frame.len = json.length();
+        httpd_ws_send_frame_async(server, fds[i], &frame);
+    }
+}
+
+// fd asks for the preview or has enough of it, every new client gets a key frame
+void Webserver::preview_client(int fd, bool on)
+{
+    int i;
+    for(i=0; i<nr_preview && preview_fd[i] != fd; i++)
+        ;
+    if(!on) {
+        if(i < nr_preview)
+            preview_fd[i] = preview_fd[--nr_preview];
+        if(nr_preview == 0)
+            stop_preview();
+        return;
+    }
+    if(i == nr_preview) {
+        if(nr_preview == PREVIEW_MAX_CLIENTS) {
+            ESP_LOGW(TAG, "preview: no more than %d clients", PREVIEW_MAX_CLIENTS);
+            return;
+        }
+        preview_fd[nr_preview++] = fd;
+    }
+
+    if(nr_preview == 1 && !esp_timer_is_active(preview_timer)) {
+        preview.start(CONFIG_LED_PREVIEW_RATE, CONFIG_LED_PREVIEW_KBPS * 1024);
+        esp_timer_start_periodic(preview_timer, 1000000 / CONFIG_LED_PREVIEW_RATE);
+    }
+    preview.restart();
+}
+
+void Webserver::stop_preview()
+{
+    esp_timer_stop(preview_timer);
+    if(preview_strip)
+        preview_strip->set_preview(NULL);
+    preview_strip = NULL;
+    preview.stop();
+}
+
+void Webserver::c_preview_timer(void* arg)
+{
+    Webserver* webserver = (Webserver*)arg;
+    // a slow httpd task skips preview frames instead of queueing them up
+    if(webserver->server && !webserver->preview_queued) {
+        webserver->preview_queued = true;
+        if(httpd_queue_work(webserver->server, c_preview_work, webserver) != ESP_OK)
+            webserver->preview_queued = false;
+    }
+}
+
+void Webserver::c_preview_work(void* arg)
+{
+    Webserver* webserver = (Webserver*)arg;
+    webserver->send_preview();
+    webserver->preview_queued = false;
+}
+
+void Webserver::send_preview()
+{
+    for(int i=0; i<nr_preview; ) {
+        if(httpd_ws_get_fd_info(server, preview_fd[i]) != HTTPD_WS_CLIENT_WEBSOCKET)
+            preview_fd[i] = preview_fd[--nr_preview];
+        else
+            i++;
+    }
+    if(nr_preview == 0) {
+        stop_preview();
+        return;
+    }
+
+    // the whole strip of the selected segment, the canvas behind the last strip
+    Ledstrip* strip = stripnr < NR_LEDSTRIPS ? &ledstrip[stripnr] : &canvas;
+    if(strip != preview_strip) {
+        if(preview_strip)
+            preview_strip->set_preview(NULL);
+        preview.restart();
+        strip->set_preview(&preview);
+        preview_strip = strip;
+    }
+
+    size_t len = preview.encode();
+    if(len == 0)
+        return;
+
+    httpd_ws_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.final = true;
+    frame.type = HTTPD_WS_TYPE_BINARY;
+    frame.payload = (uint8_t*)preview.data();
+    frame.len = len;
+    for(int i=0; i<nr_preview; i++)
+        httpd_ws_send_frame_async(server, preview_fd[i], &frame);
+}
+#endif // CONFIG_LED_WEBSOCKET
+
+// the state changed, push it to the WebSocket clients with the next frame
+void Webserver::push_state()
+{
+#if CONFIG_LED_WEBSOCKET
+    if(push_timer && !esp_timer_is_active(push_timer))
+        esp_timer_start_once(push_timer, WS_PUSH_DELAY_US);
+#endif
+}
+
 /* This handler allows the custom error handling functionality to be
  * tested from client side. For that, when a PUT request 0 is sent to
  * URI /ctrl, the /hello and /echo URIs are unregistered and following
@@ -475,60 +884,60 @@ esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
     return ESP_FAIL;
 }
 
-
-#if CONFIG_EXAMPLE_ENABLE_SSE_HANDLER
-/* An HTTP GET handler for SSE */
-static esp_err_t sse_handler(httpd_req_t *req)
-{
-    httpd_resp_set_type(req, "text/event-stream");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
-    httpd_resp_set_hdr(req, "Connection", "keep-alive");
-
-    char sse_data[64];
-    while (1) {
-        struct timeval tv;
-        gettimeofday(&tv, NULL); // Get the current time
-        int64_t time_since_boot = tv.tv_sec; // Time since boot in seconds
-        esp_err_t err;
-        int len = snprintf(sse_data, sizeof(sse_data), "data: Time since boot: %" PRIi64 " seconds\n\n", time_since_boot);
-        if ((err = httpd_resp_send_chunk(req, sse_data, len)) != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to send sse data (returned %02X)", err);
-            break;
-        }
-        vTaskDelay(pdMS_TO_TICKS(1000)); // Send data every second
-    }
-
-    httpd_resp_send_chunk(req, NULL, 0); // End response
-    return ESP_OK;
-}
-
-static const httpd_uri_t sse = {
-    .uri       = "/sse",
-    .method    = HTTP_GET,
-    .handler   = sse_handler,
-    .user_ctx  = NULL
-};
-#endif // CONFIG_EXAMPLE_ENABLE_SSE_HANDLER
-
 esp_err_t Webserver::init_leds(const char *spiffs_path)
 {
     esp_err_t ret = ESP_OK;
+    base_path = spiffs_path;
 
-    rmt.init((gpio_num_t)CONFIG_LED_STRIP1_GPIO_NUM);
+    gpio_num_t gpios[NR_LEDSTRIPS];
     for(int i=0; i<NR_LEDSTRIPS; i++)
     {
         int gpio = CONFIG_LED_STRIP1_GPIO_NUM;
         if(i > 0)
             gpio = CONFIG_LED_STRIP2_GPIO_NUM + i - 1;
+        gpios[i] = (gpio_num_t)gpio;
+    }
 
-        ret = ledstrip[i].init(spiffs_path, &rmt, (gpio_num_t)gpio);
+#if CONFIG_LED_PARALLEL_OUTPUT
+    ret = rmt.init(gpios, NR_LEDSTRIPS, true);
+#else
+    ret = rmt.init(gpios, NR_LEDSTRIPS, false);
+#endif
+    if(ret != ESP_OK)
+        return ret;
+    saver.start();
+    // the render task starts the synchronized frames when their sync window times out
+    sched.set_poll(RmtTxDriver::c_poll, &rmt);
+
+    for(int i=0; i<NR_LEDSTRIPS; i++)
+    {
+        int gpio = gpios[i];
+        ret = ledstrip[i].init(spiffs_path, &rmt, &sched, &saver, (gpio_num_t)gpio);
         if(ret != ESP_OK)
         {
             ESP_LOGE(TAG, "failed to initialize ledstripat GPIO %d", gpio);
-            break;
+            return ret;
         }
     }
-    return ret;
+
+    ret = canvas.init(spiffs_path, &rmt, &sched, &saver, GPIO_NUM_NC);
+    if(ret != ESP_OK)
+        return ret;
+    snprintf(canvas_path, sizeof(canvas_path), "%s/canvas_strips.bin", spiffs_path);
+    FILE* f = fopen(canvas_path, "r");
+    if(f)
+    {
+        uint32_t nr[LED_MAX_CANVAS];
+        int n = fread(nr, sizeof(uint32_t), LED_MAX_CANVAS, f);
+        fclose(f);
+        if(n > 0)
+            set_canvas(nr, n);
+    }
+    else
+    {
+        canvas.set_canvas(NULL, 0);
+    }
+    return sched.start();
 }
 
 esp_err_t Webserver::start(const char *spiffs_path)
@@ -536,6 +945,7 @@ esp_err_t Webserver::start(const char *spiffs_path)
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.max_uri_handlers = 1; 
     httpd_uri_t handler;
+    memset(&handler, 0, sizeof(handler));
 
     handler.method = HTTP_GET;
     handler.user_ctx  = this;
@@ -559,6 +969,22 @@ esp_err_t Webserver::start(const char *spiffs_path)
 
     for(int i=0; websvr_table[i].type; i++)
         config.max_uri_handlers++;
+#if CONFIG_LED_WEBSOCKET
+    config.max_uri_handlers++;
+    esp_timer_create_args_t timer_args = {
+        .callback = c_push_timer,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ws_push",
+        .skip_unhandled_events = true,
+    };
+    if(push_timer == NULL)
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &push_timer));
+    timer_args.callback = c_preview_timer;
+    timer_args.name = "ws_preview";
+    if(preview_timer == NULL)
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &preview_timer));
+#endif
         
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -569,19 +995,22 @@ esp_err_t Webserver::start(const char *spiffs_path)
         for(int i=0; Ledstrip::ledfunc_table[i].algo; i++)
         {
             handler.handler   = c_led_get_handler;
-            handler.uri = Ledstrip::ledfunc_table[i].uri.c_str();
+            handler.uri = Ledstrip::ledfunc_table[i].uri;
             httpd_register_uri_handler(server, &handler);
         }
         for(int i=0; websvr_table[i].type; i++)
         {
-            handler.uri = websvr_table[i].uri.c_str();
+            handler.uri = websvr_table[i].uri;
             handler.handler = websvr_table[i].handler;
             httpd_register_uri_handler(server, &handler);
         }
-        ESP_ERROR_CHECK(start_file_server(server, spiffs_path));
-#if CONFIG_EXAMPLE_ENABLE_SSE_HANDLER
-        httpd_register_uri_handler(server, &sse); // Register SSE handler
+#if CONFIG_LED_WEBSOCKET
+        handler.uri = "/ws";
+        handler.handler = c_ws_handler;
+        handler.is_websocket = true;
+        httpd_register_uri_handler(server, &handler);
 #endif
+        ESP_ERROR_CHECK(start_file_server(server, spiffs_path));
 #if CONFIG_EXAMPLE_BASIC_AUTH
         httpd_register_basic_auth(server);
 #endif
@@ -596,82 +1025,13 @@ esp_err_t Webserver::start(const char *spiffs_path)
 esp_err_t Webserver::stop()
 {
     // Stop the httpd server
+    if(push_timer)
+        esp_timer_stop(push_timer);
+    if(preview_timer)
+        esp_timer_stop(preview_timer);
     esp_err_t err = httpd_stop(server);
     server = NULL;
     return err;
 }
 
-// Funktion zur Dekodierung von URL-kodiertem Text (char*)
-size_t Webserver::urlDecode(const char* str, char* result, size_t resultlen) 
-{
-    if (str == NULL) {
-        return 0;
-    }
-
-    // Berechne die maximale Länge des dekodierten Strings
-    size_t len = strlen(str);
-    if (result == NULL) {
-        return 0; // Speicherallokation fehlgeschlagen
-    }
-
-    size_t resultIndex = 0;
-    for (size_t i = 0; i < len; ++i) {
-        if (str[i] == '%') {
-            // Prüfe, ob genug Zeichen für eine hexadezimale Kodierung vorhanden sind
-            if (i + 2 >= len) {
-                // Ungültiges Format, breche ab oder behandle als Fehler
-                result[resultIndex++] = str[i];
-                continue;
-            }
-
-            // Extrahiere die hexadezimalen Zeichen
-            char hexStr[] = { str[i + 1], str[i + 2], '\0' };
-            int decodedChar;
-            sscanf(hexStr, "%2x", &decodedChar);
-
-            // Füge das dekodierte Zeichen zum Ergebnis hinzu
-            result[resultIndex++] = (char)decodedChar;
-            i += 2; // Überspringe die nächsten beiden Zeichen
-        } else if (str[i] == '+') {
-            // '+' wird in URL-kodierten Texten als Leerzeichen interpretiert
-            result[resultIndex++] = ' ';
-        } else {
-            // Normale Zeichen werden unverändert übernommen
-            result[resultIndex++] = str[i];
-        }
-        if(resultIndex >= resultlen - 1)
-            break;
-    }
-
-    result[resultIndex] = '\0'; // Null-Terminator setzen
-    return resultIndex;
-}
-
-bool Webserver::query_key_nr(httpd_req_t *req, const char *key, unsigned long *nr)
-{
-    char val[16];
-    if(!query_key_str(req, key, val, sizeof(val)))
-        return false;
-
-    *nr = strtoul(val, NULL, 10);
-    return true;
-}
-
-bool Webserver::query_key_str(httpd_req_t *req, const char *key, char *str, size_t strlen)
-{
-    size_t buf_len = httpd_req_get_url_query_len(req);
-    if (buf_len <= 0) 
-        return false;
-    
-    char buf[buf_len+1];
-    char val[buf_len+1] = { 0 };
-    if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) != ESP_OK) 
-        return false;
-
-    if (httpd_query_key_value(buf, key, val, sizeof(val)) != ESP_OK) 
-        return false;
-
-    urlDecode(val, str, strlen);
-    return true;
-}
 #endif // !CONFIG_IDF_TARGET_LINUX
@@ -2,11 +2,16 @@
 #include "esp_http_server.h"
 #include "Ledstrip.h"
 #include "RmtTxDriver.h"
+#include "RenderScheduler.h"
+#include "ConfigSaver.h"
+#include "HttpQuery.h"
+#include "esp_timer.h"
 #include <string.h>
 
 using namespace std;
 
 #define NR_LEDSTRIPS    CONFIG_NR_LEDSTRIPS
+#define PREVIEW_MAX_CLIENTS 4
 
 typedef enum {
     URI_END = 0,
@@ -22,22 +27,53 @@ typedef enum {
 
 typedef struct {
     websvr_uri_t type;
-    string uri;
+    const char* uri;
     esp_err_t (*handler)(httpd_req_t *req);
 } websvr_table_t;
 
 
 class Webserver {
     httpd_handle_t server;
+    ConfigSaver saver;      // before the strips, they write their pending changes when they are destroyed
+    PixelPreview preview;   // before the strips, the previewed one may still hold it
     Ledstrip ledstrip[NR_LEDSTRIPS];
+    Ledstrip canvas;        // after ledstrip, the strips leave the canvas before they are destroyed
     static const websvr_table_t websvr_table[];
     RmtTxDriver rmt;
+    RenderScheduler sched;
 
     uint32_t loop_delay;
     uint32_t stripnr;
+    uint32_t segnr;         // 0: the whole strip, else segment segnr - 1
     int colorcnt;
+    char canvas_path[32];   // strips of the canvas
+    string canvas_strips;   // e.g. "0,1,2"
+    string base_path;       // of the SPIFFS, point lists are read from there
+    HttpQuery query;        // of the current request, the handlers all run in the httpd task
+    esp_timer_handle_t push_timer;  // state changes within one frame are pushed together
+    char ws_msg[CONFIG_HTTPD_MAX_URI_LEN];  // control message of a WebSocket client
+    int preview_fd[PREVIEW_MAX_CLIENTS];    // WebSocket clients that asked for the preview
+    int nr_preview;
+    Ledstrip* preview_strip;                // strip the preview is taken from
+    esp_timer_handle_t preview_timer;
+    volatile bool preview_queued;           // send_preview() is queued in the httpd task
 
-    bool parse_stripnr(httpd_req_t *req);
+    static websvr_uri_t route_type(const char* uri);
+    bool parse_stripnr();
+    Ledstrip* selected();
+    esp_err_t set_canvas(const uint32_t* nr, int n);
+    bool led_control(const char* uri);
+    void power();
+    string state_json();
+    void push_state();
+    static void c_push_timer(void* arg);
+    static void c_push_work(void* arg);
+    void send_state();
+    void preview_client(int fd, bool on);
+    static void c_preview_timer(void* arg);
+    static void c_preview_work(void* arg);
+    void send_preview();
+    void stop_preview();
 
 public:
     Webserver();
@@ -46,9 +82,6 @@ public:
     esp_err_t init_leds(const char *spiffs_path);
     esp_err_t start(const char *spiffs_path);
     esp_err_t stop();
-    static size_t urlDecode(const char* str, char* result, size_t resultlen);
-    static bool query_key_nr(httpd_req_t *req, const char *key, unsigned long *nr);
-    static bool query_key_str(httpd_req_t *req, const char *key, char *str, size_t strlen);
     esp_err_t led_get_handler(httpd_req_t *req);
     esp_err_t led_set_handler(httpd_req_t *req);
     esp_err_t get_wifi_handler(httpd_req_t *req);
@@ -56,6 +89,7 @@ public:
     esp_err_t led_val_handler(httpd_req_t *req);
     esp_err_t led_power_handler(httpd_req_t *req);
     esp_err_t led_strip_handler(httpd_req_t *req);
+    esp_err_t ws_handler(httpd_req_t *req);
 
     static string to_json(const string& tag, uint32_t nr);
     static string to_json(const string& tag, const string& str);
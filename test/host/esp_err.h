@@ -0,0 +1,8 @@
+/* esp_err.h for host builds of the sources in main, only what they use */
+#pragma once
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NOT_FOUND       0x105
@@ -0,0 +1,15 @@
+/* esp_http_server.h for host builds of the sources in main, only what they use */
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifndef CONFIG_HTTPD_MAX_URI_LEN
+#define CONFIG_HTTPD_MAX_URI_LEN    512
+#endif
+
+#define ESP_ERR_HTTPD_RESULT_TRUNC  0xb006
+
+typedef struct httpd_req {
+    const char* uri;
+} httpd_req_t;
@@ -0,0 +1,159 @@
+/* hsv_compare.c
+   Host check of the integer HSV conversion in main/hsv.h against the float
+   function it replaced, over every hue, saturation and value the old one took.
+
+   cc -O2 -I main test/hsv_compare.c -o hsv_compare && ./hsv_compare
+
+   Fails if a channel differs by more than MAX_DIFF.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hsv.h"
+
+#define MAX_DIFF    3       // LSB, the old code truncated v * 2.55f
+#define BENCH_RUNS  20
+
+// led_strip_hsv2rgb() of the released firmware: h in degrees, s and v in percent
+static void old_hsv2rgb(uint32_t h, uint32_t s, uint32_t v, uint32_t *r, uint32_t *g, uint32_t *b)
+{
+    h %= 360; // h -> [0,360]
+    uint32_t rgb_max = v * 2.55f;
+    uint32_t rgb_min = rgb_max * (100 - s) / 100.0f;
+
+    uint32_t i = h / 60;
+    uint32_t diff = h % 60;
+
+    // RGB adjustment amount by hue
+    uint32_t rgb_adj = (rgb_max - rgb_min) * diff / 60;
+
+    switch (i) {
+    case 0:
+        *r = rgb_max;
+        *g = rgb_min + rgb_adj;
+        *b = rgb_min;
+        break;
+    case 1:
+        *r = rgb_max - rgb_adj;
+        *g = rgb_max;
+        *b = rgb_min;
+        break;
+    case 2:
+        *r = rgb_min;
+        *g = rgb_max;
+        *b = rgb_min + rgb_adj;
+        break;
+    case 3:
+        *r = rgb_min;
+        *g = rgb_max - rgb_adj;
+        *b = rgb_max;
+        break;
+    case 4:
+        *r = rgb_min + rgb_adj;
+        *g = rgb_min;
+        *b = rgb_max;
+        break;
+    default:
+        *r = rgb_max;
+        *g = rgb_min;
+        *b = rgb_max - rgb_adj;
+        break;
+    }
+}
+
+// percent to 0..255, rounded
+static uint8_t to8(uint32_t pct)
+{
+    return (pct * 255 + 50) / 100;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+    uint32_t max_diff = 0;
+    uint64_t sum_diff = 0;
+    uint64_t n = 0;
+    uint32_t worst_h = 0, worst_s = 0, worst_v = 0;
+
+    for(uint32_t h=0; h<360; h++)
+    {
+        for(uint32_t s=0; s<=100; s++)
+        {
+            for(uint32_t v=0; v<=100; v++)
+            {
+                uint32_t r0, g0, b0;
+                uint8_t r1, g1, b1;
+                old_hsv2rgb(h, s, v, &r0, &g0, &b0);
+                hsv2rgb(HSV_HUE_DEG(h), to8(s), to8(v), &r1, &g1, &b1);
+
+                uint32_t d[3] = { abs((int)r0 - r1), abs((int)g0 - g1), abs((int)b0 - b1) };
+                for(int c=0; c<3; c++)
+                {
+                    sum_diff += d[c];
+                    if(d[c] > max_diff)
+                    {
+                        max_diff = d[c];
+                        worst_h = h;
+                        worst_s = s;
+                        worst_v = v;
+                    }
+                }
+                n += 3;
+            }
+        }
+    }
+    printf("accuracy: %llu channels, max diff %u LSB (h %u s %u v %u), mean %.2f LSB\n",
+           (unsigned long long)n, max_diff, worst_h, worst_s, worst_v, (double)sum_diff / n);
+
+    // throughput, one full rainbow per run as rainbow() renders it
+    volatile uint32_t sink = 0;
+    uint32_t pixels = 0;
+    double t0 = now_ns();
+    for(int run=0; run<BENCH_RUNS; run++)
+    {
+        for(uint32_t v=0; v<=100; v++)
+        {
+            for(uint32_t h=0; h<360; h++)
+            {
+                uint32_t r, g, b;
+                old_hsv2rgb(h, 100, v, &r, &g, &b);
+                sink += r + g + b;
+                pixels++;
+            }
+        }
+    }
+    double t1 = now_ns();
+    for(int run=0; run<BENCH_RUNS; run++)
+    {
+        for(uint32_t v=0; v<=100; v++)
+        {
+            uint8_t v8 = to8(v);
+            for(uint32_t h=0; h<HSV_HUE_STEPS; h++)
+            {
+                uint8_t r, g, b;
+                hsv2rgb(h, 255, v8, &r, &g, &b);
+                sink += r + g + b;
+            }
+        }
+    }
+    double t2 = now_ns();
+    uint32_t new_pixels = BENCH_RUNS * HSV_HUE_STEPS * 101;
+    printf("throughput: float %.2f ns/pixel, integer %.2f ns/pixel\n",
+           (t1 - t0) / pixels, (t2 - t1) / new_pixels);
+
+    if(max_diff > MAX_DIFF)
+    {
+        printf("FAIL: more than %d LSB off\n", MAX_DIFF);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,252 @@
+/* http_bench.cpp
+   Host benchmark of the request routing and query parsing of led_control(),
+   HttpQuery and exact routes against the per-key query fetch and substring routes they replaced.
+
+   c++ -O2 -I test/host -I main test/http_bench.cpp main/HttpQuery.cpp -o http_bench && ./http_bench
+
+   Reports requests per second and heap allocations per request of both.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <string>
+#include "HttpQuery.h"
+
+using namespace std;
+
+#define BENCH_REQUESTS  200000
+
+// a color wheel request of the web UI, as led_control() gets it
+static const char* request = "/rainbowclk?strip=1&seg=0&bright=80&red=255&green=128&blue=0&speed=120&text=Hello%20World%21";
+static const char* const num_keys[] = { "strip", "seg", "bright", "red", "green", "blue", "speed" };
+
+static const char* const effect_uris[] = {
+    "/mono", "/rainbow", "/rainbowclk", "/walk", "/clock2", "/gradient", "/belt", "/fire", "/plasma", "/text",
+};
+static const char* const server_uris[] = {
+    "/speed", "/led", "/values", "/set", "/power", "/strips", "/getwifi", "/setwifi",
+};
+#define NR_EFFECTS  (sizeof(effect_uris) / sizeof(effect_uris[0]))
+#define NR_ROUTES   (sizeof(server_uris) / sizeof(server_uris[0]))
+
+// every heap allocation, std::string included
+static unsigned long allocs;
+
+void* operator new(size_t size)
+{
+    allocs++;
+    void* p = malloc(size ? size : 1);
+    if(p == NULL)
+        abort();
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+/* ---- the replaced code: the query is fetched and scanned again for every key ---- */
+
+// httpd_req_get_url_query_len() / _str() and httpd_query_key_value() as esp_http_server does them
+static size_t old_query_len(const char* uri)
+{
+    const char* q = strchr(uri, '?');
+    return q ? strlen(q + 1) : 0;
+}
+
+static esp_err_t old_query_str(const char* uri, char* buf, size_t len)
+{
+    const char* q = strchr(uri, '?');
+    if(q == NULL)
+        return ESP_ERR_NOT_FOUND;
+    snprintf(buf, len, "%s", q + 1);
+    return ESP_OK;
+}
+
+static esp_err_t old_key_value(const char* qry, const char* key, char* val, size_t val_size)
+{
+    const char* p = qry;
+    while(*p)
+    {
+        const char* end = strchr(p, '&');
+        if(end == NULL)
+            end = p + strlen(p);
+        const char* eq = strchr(p, '=');
+        if(eq && eq < end && (size_t)(eq - p) == strlen(key) && strncmp(p, key, eq - p) == 0)
+        {
+            eq++;
+            size_t n = end - eq < (long)val_size - 1 ? end - eq : val_size - 1;
+            memcpy(val, eq, n);
+            val[n] = 0;
+            return (size_t)(end - eq) > n ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+// Webserver::urlDecode() before HttpQuery
+static size_t old_url_decode(const char* str, char* result, size_t resultlen)
+{
+    size_t len = strlen(str);
+    size_t resultIndex = 0;
+    for(size_t i = 0; i < len; ++i)
+    {
+        if(str[i] == '%')
+        {
+            if(i + 2 >= len)
+            {
+                result[resultIndex++] = str[i];
+                continue;
+            }
+            char hexStr[] = { str[i + 1], str[i + 2], '\0' };
+            int decodedChar;
+            sscanf(hexStr, "%2x", &decodedChar);
+            result[resultIndex++] = (char)decodedChar;
+            i += 2;
+        }
+        else if(str[i] == '+')
+        {
+            result[resultIndex++] = ' ';
+        }
+        else
+        {
+            result[resultIndex++] = str[i];
+        }
+        if(resultIndex >= resultlen - 1)
+            break;
+    }
+    result[resultIndex] = '\0';
+    return resultIndex;
+}
+
+static bool old_key_str(const char* uri, const char* key, char* str, size_t strlen)
+{
+    size_t buf_len = old_query_len(uri);
+    if(buf_len <= 0)
+        return false;
+
+    char buf[buf_len + 1];
+    char val[buf_len + 1];
+    val[0] = 0;
+    if(old_query_str(uri, buf, sizeof(buf)) != ESP_OK)
+        return false;
+    if(old_key_value(buf, key, val, sizeof(val)) != ESP_OK)
+        return false;
+
+    old_url_decode(val, str, strlen);
+    return true;
+}
+
+static bool old_key_nr(const char* uri, const char* key, unsigned long* nr)
+{
+    char val[16];
+    if(!old_key_str(uri, key, val, sizeof(val)))
+        return false;
+    *nr = strtoul(val, NULL, 10);
+    return true;
+}
+
+static unsigned long old_request(const char* uri)
+{
+    unsigned long sum = 0;
+    unsigned long nr;
+    for(const char* key : num_keys)
+    {
+        if(old_key_nr(uri, key, &nr))
+            sum += nr;
+    }
+    char text[64];
+    if(old_key_str(uri, "text", text, sizeof(text)))
+        sum += text[0];
+
+    for(size_t i=0; i<NR_EFFECTS; i++)
+    {
+        if(string(uri).find(effect_uris[i]) != string::npos)
+            sum += i;
+    }
+    for(size_t i=0; i<NR_ROUTES; i++)
+    {
+        if(string(uri).find(server_uris[i]) != string::npos)
+            sum += i;
+    }
+    return sum;
+}
+
+/* ---- the current code: one parse, exact routes ---- */
+
+// as route_is() in webserver.cpp
+static bool route_is(const char* uri, size_t len, const char* route)
+{
+    return strncmp(uri, route, len) == 0 && route[len] == 0;
+}
+
+static HttpQuery query;
+
+static unsigned long new_request(const char* uri)
+{
+    unsigned long sum = 0;
+    uint32_t nr;
+    query.parse_uri(uri);
+    for(const char* key : num_keys)
+    {
+        if(query.get_nr(key, &nr))
+            sum += nr;
+    }
+    char text[64];
+    if(query.get_str("text", text, sizeof(text)))
+        sum += text[0];
+
+    size_t len = strcspn(uri, "?");
+    for(size_t i=0; i<NR_EFFECTS; i++)
+    {
+        if(route_is(uri, len, effect_uris[i]))
+        {
+            sum += i;
+            break;
+        }
+    }
+    for(size_t i=0; i<NR_ROUTES; i++)
+    {
+        if(route_is(uri, len, server_uris[i]))
+        {
+            sum += i;
+            break;
+        }
+    }
+    return sum;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char* name, unsigned long (*fn)(const char*))
+{
+    volatile unsigned long sink = 0;
+    unsigned long a0 = allocs;
+    double t0 = now_s();
+    for(int i=0; i<BENCH_REQUESTS; i++)
+        sink += fn(request);
+    double t = now_s() - t0;
+    printf("%-8s %10.0f requests/s  %5.1f allocations/request\n",
+           name, BENCH_REQUESTS / t, (double)(allocs - a0) / BENCH_REQUESTS);
+}
+
+int main(void)
+{
+    // the same values; the substring routes also take "/rainbow" (1) for "/rainbowclk"
+    if(old_request(request) != new_request(request) + 1)
+    {
+        printf("FAIL: the parsers disagree\n");
+        return 1;
+    }
+    bench("old", old_request);
+    bench("current", new_request);
+    return 0;
+}
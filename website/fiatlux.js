@@ -1,4 +1,10 @@
 var mycolor;
+var colorPicker;
+var socket = null;
+var selected_strip = 0;
+var remote_update = false;  // the picker is set from a pushed state, not by the user
+var last_sent = 0;
+var preview_px = new Uint8Array(0);    // RGB per LED, as the strip shows it
 
 function trigger_restapi(url)
 {
@@ -23,6 +29,111 @@ function trigger_restapi(url)
     });
 }
 
+// over the WebSocket if it is open, else as a GET request
+function control(url)
+{
+    last_sent = Date.now();
+    if(socket && socket.readyState == WebSocket.OPEN) {
+        socket.send(url);
+    }
+    else {
+        trigger_restapi(url);
+    }
+}
+
+// the state of the selected strip, pushed after every change by any client
+function onState(data)
+{
+    if(data.strip != selected_strip) {
+        location.reload();
+        return;
+    }
+    document.getElementById("speedRange").value = data.speed;
+    var text = document.getElementById("tickertext");
+    if(document.activeElement != text) {
+        text.value = data.text;
+    }
+    // the wheel of this client is ahead of the state of its own changes
+    if(colorPicker && Date.now() - last_sent > 500) {
+        remote_update = true;
+        colorPicker.color.set({ r: data.red, g: data.green, b: data.blue });
+        colorPicker.color.value = data.bright;
+        remote_update = false;
+    }
+}
+
+function openSocket()
+{
+    socket = new WebSocket(`ws://${location.host}/ws`);
+    socket.binaryType = "arraybuffer";
+    socket.onopen = function() {
+        if(document.getElementById("previewon").checked) {
+            socket.send("/preview?on=1");
+        }
+    };
+    socket.onmessage = function(event) {
+        if(typeof event.data == "string") {
+            onState(JSON.parse(event.data));
+        }
+        else {
+            onPreview(event.data);
+        }
+    };
+    socket.onclose = function() {
+        socket = null;
+        setTimeout(openSocket, 2000);
+    };
+}
+
+function previewToggle()
+{
+    var on = document.getElementById("previewon").checked;
+    if(socket && socket.readyState == WebSocket.OPEN) {
+        socket.send(`/preview?on=${on ? 1 : 0}`);
+    }
+    if(!on) {
+        document.getElementById("preview").height = 0;
+    }
+}
+
+// 'P', 1 for a key frame, number of LEDs, then runs of: first LED, number of LEDs, RGB per LED
+function onPreview(buf)
+{
+    var d = new DataView(buf);
+    if(buf.byteLength < 4 || d.getUint8(0) != 0x50) {
+        return;
+    }
+    var n = d.getUint16(2, true);
+    if(d.getUint8(1) || preview_px.length != n * 3) {
+        preview_px = new Uint8Array(n * 3);
+    }
+    var pos = 4;
+    while(pos + 4 <= buf.byteLength) {
+        var first = d.getUint16(pos, true);
+        var cnt = d.getUint16(pos + 2, true);
+        pos += 4;
+        preview_px.set(new Uint8Array(buf, pos, cnt * 3), first * 3);
+        pos += cnt * 3;
+    }
+    drawPreview(n);
+}
+
+function drawPreview(n)
+{
+    var canvas = document.getElementById("preview");
+    var cell = n > 500 ? 4 : 8;
+    var per_row = Math.floor(canvas.width / cell);
+    var height = Math.ceil(n / per_row) * cell;
+    if(canvas.height != height) {
+        canvas.height = height;
+    }
+    var ctx = canvas.getContext("2d");
+    for(var i=0; i<n; i++) {
+        ctx.fillStyle = `rgb(${preview_px[3*i]},${preview_px[3*i+1]},${preview_px[3*i+2]})`;
+        ctx.fillRect((i % per_row) * cell, Math.floor(i / per_row) * cell, cell - 1, cell - 1);
+    }
+}
+
 async function onLoad()
 {
     var brightness = 100;
@@ -58,6 +169,8 @@ async function onLoad()
         // Extract the 3 variables
         hexString = "#" + data.red.toString(16).padStart(2, '0') + data.green.toString(16).padStart(2, '0') + data.blue.toString(16).padStart(2, '0');
         brightness = data.bright;
+        selected_strip = data1.selected_strip;
+        document.getElementById("tickertext").value = data.text;
 
         var slider = document.getElementById("speedRange");
         slider.value = data.speed;
@@ -74,7 +187,7 @@ async function onLoad()
     }
 
     // using github.com/jaames/iro.js
-    var colorPicker = new iro.ColorPicker('#picker', {
+    colorPicker = new iro.ColorPicker('#picker', {
         // Set the size of the color picker
         width: width,
         // Set the initial color to pure red
@@ -87,81 +200,100 @@ async function onLoad()
     // color:change callbacks receive the current color
     colorPicker.on(['color:init', 'color:change'], function(color) {
         mycolor = color;
-        const url = `/led?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}&bright=${mycolor.value}`;
-        trigger_restapi(url)
+        if(!remote_update) {
+            const url = `/led?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}&bright=${mycolor.value}`;
+            control(url);
+        }
         var btn1 = document.getElementById("monobutton");
         btn1.style.backgroundColor = color.hexString;
         var btn2 = document.getElementById("gradientbutton");
         btn2.style.background = `linear-gradient(90deg,rgba(0, 0, 0, 1), rgba(${mycolor.red}, ${mycolor.green}, ${mycolor.blue}, 1), rgba(0, 0, 0, 1))`
     });
+
+    openSocket();
 }
 
 function mono()
 {
     const url = `/mono?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function gradient()
 {
     const url = `/gradient?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function rainbow()
 {
     const url = `/rainbow?bright=${mycolor.value}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function rainbowclk()
 {
     const url = `/rainbowclk?bright=${mycolor.value}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function walking()
 {
     var slider = document.getElementById("speedRange");
     const url = `/walk?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}&speed=${slider.value}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function belt()
 {
     var slider = document.getElementById("speedRange");
     const url = `/belt?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}&speed=${slider.value}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function fire()
 {
     var slider = document.getElementById("speedRange");
     const url = `/fire?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}&speed=${slider.value}`;
-    trigger_restapi(url);
+    control(url);
+}
+
+function plasma()
+{
+    var slider = document.getElementById("speedRange");
+    const url = `/plasma?speed=${slider.value}`;
+    control(url);
+}
+
+function ticker()
+{
+    var slider = document.getElementById("speedRange");
+    var text = document.getElementById("tickertext");
+    const url = `/text?red=${mycolor.red}&green=${mycolor.green}&blue=${mycolor.blue}&speed=${slider.value}&text=${encodeURIComponent(text.value)}`;
+    control(url);
 }
 
 function speedSlide() 
 {
     var slider = document.getElementById("speedRange");
     const url = `/speed?speed=${slider.value}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function clock2()
 {
     const url = `/clock2?bright=${mycolor.value}`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function onoff()
 {
     const url = `/power`;
-    trigger_restapi(url);
+    control(url);
 }
 
 function stripselect(nr)
 {
     const url = `/led?strip=${nr}`;
-    trigger_restapi(url);
+    control(url);
 }
@@ -18,6 +18,17 @@ async function loadSettings()
         led1.value = data.led1;
         var fade = document.getElementById("fadein");
         fade.value = data.fadein;
+        var gamma = document.getElementById("gamma");
+        gamma.value = data.gamma;
+        var white = document.getElementById("white");
+        white.value = "#" + data.white.toString(16).padStart(6, '0');
+        var segments = document.getElementById("segments");
+        segments.value = data.segments;
+        var canvas = document.getElementById("canvas");
+        canvas.value = data.canvas;
+        document.getElementById("matrix").value = data.matrix;
+        document.getElementById("wiring").value = data.wiring;
+        document.getElementById("origin").value = data.origin;
         setRotation(data.rotate);
 
         // Use them however you want (no page refresh)